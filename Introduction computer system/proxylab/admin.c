@@ -0,0 +1,173 @@
+/*                                                                            *
+ *  admin.c                                                                   *
+ *  this file serves the proxy's admin socket  . :)                           *
+ *  a unix-domain stream socket, only reachable by the proxy's user, that     *
+ *  takes one command per line and answers "OK <removed>" or "ERR <why>":     *
+ *      PURGE http://host[:port]/path       every variant of one url          *
+ *      PURGE-PREFIX http://host[:port]/p   every url under a path prefix     *
+ *      PURGE-HOST host[:port]              everything of a host              *
+ *      FLUSH                               the whole cache                   *
+ *                                                                            *
+ */
+#include "admin.h"
+#include "cache.h"
+#include <strings.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#define ADMIN_HOSTLEN 256
+#define ADMIN_PORTLEN 8
+
+/*
+ * split_authority : "host[:port]" into its parts, port NULL-able when the
+ * caller accepts "any port". Returns false on a malformed authority.
+ */
+static bool split_authority(const char *auth, size_t len, char *host,
+                            char *port, bool need_port)
+{
+    const char *colon = memchr(auth, ':', len);
+    size_t hostlen = colon != NULL ? (size_t)(colon - auth) : len;
+    if (hostlen == 0 || hostlen >= ADMIN_HOSTLEN) {
+        return false;
+    }
+    memcpy(host, auth, hostlen);
+    host[hostlen] = '\0';
+
+    if (colon == NULL) {
+        strcpy(port, need_port ? "80" : "");
+        return true;
+    }
+    size_t portlen = len - hostlen - 1;
+    if (portlen == 0 || portlen >= ADMIN_PORTLEN
+            || strspn(colon + 1, "0123456789") < portlen) {
+        return false;
+    }
+    memcpy(port, colon + 1, portlen);
+    port[portlen] = '\0';
+    return true;
+}
+
+/*
+ * split_url : "http://host[:port]/path" the way the cache keys it
+ */
+static bool split_url(const char *url, char *host, char *port, char **ppath)
+{
+    if (strncasecmp(url, "http://", 7) != 0) {
+        return false;
+    }
+    url += 7;
+    size_t authlen = strcspn(url, "/");
+    if (url[authlen] != '/' || !split_authority(url, authlen, host, port,
+                                                true)) {
+        return false;
+    }
+    *ppath = (char *)url + authlen;
+    return true;
+}
+
+/*
+ * admin_command : run one command line, reply into out
+ */
+static void admin_command(char *line, char *out, size_t outlen)
+{
+    char host[ADMIN_HOSTLEN], port[ADMIN_PORTLEN];
+    char *path;
+    char *arg = line + strcspn(line, " ");
+    if (*arg == ' ') {
+        *arg++ = '\0';
+    }
+
+    if (strcasecmp(line, "FLUSH") == 0 && *arg == '\0') {
+        snprintf(out, outlen, "OK %zu\n", cache_flush());
+    } else if (strcasecmp(line, "PURGE") == 0
+               && split_url(arg, host, port, &path)) {
+        snprintf(out, outlen, "OK %zu\n",
+                 cache_purge(host, port, path, false));
+    } else if (strcasecmp(line, "PURGE-PREFIX") == 0
+               && split_url(arg, host, port, &path)) {
+        snprintf(out, outlen, "OK %zu\n",
+                 cache_purge(host, port, path, true));
+    } else if (strcasecmp(line, "PURGE-HOST") == 0
+               && split_authority(arg, strlen(arg), host, port, false)) {
+        snprintf(out, outlen, "OK %zu\n",
+                 cache_purge_host(host, port[0] != '\0' ? port : NULL));
+    } else {
+        snprintf(out, outlen, "ERR unknown command or bad argument\n");
+    }
+}
+
+/* Thread routine, serves admin connections one at a time */
+static void *admin_thread(void *vargp)
+{
+    int listenfd = (int)(long)vargp;
+    pthread_detach(pthread_self());
+
+    while (1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "admin: accept error: %s\n", strerror(errno));
+            if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+                return NULL;        // the socket itself is gone
+            }
+            sleep(1);               // out of fds or memory, let it pass
+            continue;
+        }
+        set_sock_timeouts(connfd, 30000, 30000);
+
+        rio_t rio;
+        char line[MAXLINE], reply[MAXLINE];
+        rio_readinitb(&rio, connfd);
+        while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0') {
+                continue;
+            }
+            admin_command(line, reply, sizeof(reply));
+            printf("admin: %s -> %s", line, reply);
+            if (rio_writen(connfd, reply, strlen(reply)) < 0) {
+                break;
+            }
+        }
+        Close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * admin_start : listen on a unix-domain socket at path, replacing a stale
+ * one, and serve it from a background thread. Call it before starting
+ * other threads.
+ */
+bool admin_start(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "admin socket path too long: %s\n", path);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        return false;
+    }
+    // created owner-only from the start, called before any other thread
+    unlink(path);
+    mode_t mask = umask(S_IRWXG | S_IRWXO);
+    int rc = bind(listenfd, (SA *) &addr, sizeof(addr));
+    umask(mask);
+    if (rc < 0 || listen(listenfd, 8) < 0) {
+        fprintf(stderr, "admin socket %s: %s\n", path, strerror(errno));
+        close(listenfd);
+        return false;
+    }
+
+    pthread_t tid;
+    Pthread_create(&tid, NULL, admin_thread, (void *)(long)listenfd);
+    return true;
+}
@@ -0,0 +1,15 @@
+/*                                                                            *
+ *  admin.h                                                                   *
+ *  this file is head file for admin.c  :)                                    *
+ *  a local control socket for purging and flushing the cache                 *
+ *                                                                            *
+ */
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "csapp.h"
+#include <stdbool.h>
+
+bool admin_start(const char *path);
+
+#endif
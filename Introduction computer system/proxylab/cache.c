@@ -2,166 +2,688 @@
  *  cache.c                                                                   *
  *  this file is used for providing cache for web proxy  . :)                 *
  *              Name: Shu Liu   AndrewID: Shul2                               *
- *  our cache system is constructured as a double-ended doubly linked list    *
- *  and we can search, remove, addlast and delete node                        *
+ *  our cache system is a hash table over a double-ended doubly linked list.  *
+ *  nodes hold whole 200 responses, are pinned by reference counts while      *
+ *  a reader sends them, and are evicted in clock (second chance) order.      *
+ *  one url can hold several variants, told apart by content coding and by    *
+ *  the request fields named in Vary                                          *
  *                                                                            *
  */
 #include "cache.h"
 #include "strings.h"
 #include "stdbool.h"
+#include <time.h>
 
-// double-ended doubly linked list
-cache_node *tail;
-cache_node *head;
+#define CACHE_BUCKETS 1024
+#define HOST_BUCKETS 256
 
-size_t cache_actual_size;
+/* a double-ended doubly linked list with its own size budget */
+typedef struct {
+    cache_node *head;       // the clock hand starts here
+    cache_node *tail;
+    size_t size;
+    size_t limit;
+} cache_list;
+
+// full responses are evicted in clock order, negative ones first in
+// first out, which with a single ttl is also the order they expire in
+static cache_list objects = { NULL, NULL, 0, MAX_CACHE_SIZE };
+static cache_list negatives = { NULL, NULL, 0, MAX_NEGATIVE_CACHE_SIZE };
+static cache_node *buckets[CACHE_BUCKETS];
+static int negative_ttl;
+
+/* every entry of one host, so purges only visit what they remove */
+typedef struct cache_host {
+    char *name;
+    cache_node *nodes;
+    struct cache_host *next;
+} cache_host;
+
+static cache_host *hosts[HOST_BUCKETS];
 
 // shared control resources
-int readcnt;  // initialized as 0
-sem_t mutex, w;   // initialized as 1
+static int readcnt;  // initialized as 0
+static sem_t mutex, w;   // initialized as 1
 
 /*
- * cache_search : search for the matched cache block
+ * cache_init : initialize the cache system. Error and empty responses are
+ * kept for negative_ttl seconds, 0 turns that off.
  */
-cache_node *cache_search(char *host, char *path, char *port)
+void cache_init(int neg_ttl)
 {
-    cache_node *cur = tail;
-    while (cur != NULL) {
+  // initialize the mutex and write
+  Sem_init(&mutex, 0 , 1);
+  Sem_init(&w, 0, 1);
 
-      if ((strcasecmp(cur->cache_key.host, host) == 0)
-          && (strcasecmp(cur->cache_key.path, path) == 0)
-          && (strcasecmp(cur->cache_key.port, port) == 0)) {
-            printf("found it!\n");
-            return cur;
-      }
+  negative_ttl = neg_ttl;
+}
+
+/*
+ * reader_lock / reader_unlock : the first reader in locks out the writers,
+ * the last one out lets them back in
+ */
+static void reader_lock(void)
+{
+    P(&mutex);
+    readcnt++;
+    if (readcnt == 1) {    // first in
+        P(&w);
+    }
+    V(&mutex);
+}
 
-      cur = cur->prev;
+static void reader_unlock(void)
+{
+    P(&mutex);
+    readcnt--;
+    if (readcnt == 0) {  // last out
+        V(&w);
     }
-    // not found
-    printf("no found!\n");
-    return NULL;
+    V(&mutex);
+}
+
+static unsigned cache_hash(const char *host, const char *path,
+                           const char *port)
+{
+    unsigned h = 5381;
+    for (; *host; host++) {
+        h = h * 33 + (unsigned char)(*host | 0x20);
+    }
+    for (; *path; path++) {
+        h = h * 33 + (unsigned char)*path;
+    }
+    for (; *port; port++) {
+        h = h * 33 + (unsigned char)*port;
+    }
+    return h;
+}
+
+static unsigned cache_accept(http_request *req)
+{
+    if (req->field[HDR_ACCEPT_ENCODING].ptr == NULL) {
+        return 0;
+    }
+    return http_accept_encoding(req->field[HDR_ACCEPT_ENCODING]);
+}
+
+static bool key_match(cache_node *pnode, const char *host, const char *path,
+                      const char *port, unsigned h)
+{
+    return pnode->hash == h
+        && strcmp(pnode->cache_key.path, path) == 0
+        && strcasecmp(pnode->cache_key.host, host) == 0
+        && strcmp(pnode->cache_key.port, port) == 0;
 }
 
 /*
- * cache_init : initialize the cache system
+ * vary_match : does the request carry the same values for the varied
+ * fields as the one this variant was fetched for? The key holds each
+ * value followed by '\n', an absent field is a lone '\r'. Accept-Encoding
+ * is compared as a normalized mask: a compressed variant suits anyone who
+ * accepts its coding, identity only clients that accept the same codings,
+ * otherwise a gzip-capable client would never get the gzip variant.
  */
+static bool vary_match(cache_node *pnode, http_request *req, unsigned accept)
+{
+    if (pnode->encoding != 0) {
+        if (!(pnode->encoding & accept)) {
+            return false;
+        }
+    } else if ((pnode->vary_mask & (1u << HDR_ACCEPT_ENCODING))
+            && pnode->accept != accept) {
+        return false;
+    }
+
+    const char *key = pnode->vary_key;
+    int id;
+    for (id = 0; id < HDR_COUNT; id++) {
+        if (!(pnode->vary_mask & (1u << id)) || id == HDR_ACCEPT_ENCODING) {
+            continue;
+        }
+        http_slice v = req->field[id];
+        const char *nl = strchr(key, '\n');
+        if (v.ptr == NULL ? strncmp(key, "\r\n", 2) != 0
+                : (size_t)(nl - key) != v.len
+                  || memcmp(key, v.ptr, v.len) != 0) {
+            return false;
+        }
+        key = nl + 1;
+    }
+    return true;
+}
 
-void cache_init()
+/*
+ * cache_search : find the variant of a key that suits the request best,
+ * lock held. Among variants the client can decode, a compressed one is
+ * preferred over identity. Expired negative entries are passed over, the
+ * next insert reclaims them.
+ */
+static cache_node *cache_search(const char *host, const char *path,
+                                const char *port, unsigned h,
+                                http_request *req)
 {
-  // initialize the mutex and write
-  Sem_init(&mutex, 0 , 1);
-  Sem_init(&w, 0, 1);
+    unsigned accept = cache_accept(req);
+    time_t now = time(NULL);
+    cache_node *cur, *best = NULL;
+    for (cur = buckets[h % CACHE_BUCKETS]; cur != NULL; cur = cur->hnext) {
+        if (key_match(cur, host, path, port, h)
+                && (cur->expires == 0 || cur->expires > now)
+                && vary_match(cur, req, accept)) {
+            if (cur->encoding != 0) {
+                return cur;
+            }
+            best = cur;
+        }
+    }
+    return best;
+}
+
+/*
+ * cache_search_variant : find a stored entry that pnode would replace,
+ * lock held: the same variant, or one with a different status, which
+ * the origin no longer gives for this url
+ */
+static cache_node *cache_search_variant(cache_node *pnode)
+{
+    cache_node *cur;
+    for (cur = buckets[pnode->hash % CACHE_BUCKETS]; cur != NULL;
+            cur = cur->hnext) {
+        if (!key_match(cur, pnode->cache_key.host, pnode->cache_key.path,
+                       pnode->cache_key.port, pnode->hash)) {
+            continue;
+        }
+        if (cur->status != pnode->status) {
+            return cur;
+        }
+        if (cur->encoding == pnode->encoding
+                && cur->accept == pnode->accept
+                && cur->vary_mask == pnode->vary_mask
+                && cur->vary_len == pnode->vary_len
+                && memcmp(cur->vary_key, pnode->vary_key,
+                          pnode->vary_len) == 0) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+static char *cache_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = (char *)Malloc(len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+static unsigned host_hash(const char *host)
+{
+    unsigned h = 5381;
+    for (; *host; host++) {
+        h = h * 33 + (unsigned char)(*host | 0x20);
+    }
+    return h % HOST_BUCKETS;
+}
+
+static cache_host *host_find(const char *host)
+{
+    cache_host *e;
+    for (e = hosts[host_hash(host)]; e != NULL; e = e->next) {
+        if (strcasecmp(e->name, host) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
 
-  tail = NULL;
-  head = NULL;
+/*
+ * host_link : file a node under its host, writer lock held
+ */
+static void host_link(cache_node *pnode)
+{
+    cache_host *e = host_find(pnode->cache_key.host);
+    if (e == NULL) {
+        unsigned b = host_hash(pnode->cache_key.host);
+        e = (cache_host *)Calloc(1, sizeof(cache_host));
+        e->name = cache_strdup(pnode->cache_key.host);
+        e->next = hosts[b];
+        hosts[b] = e;
+    }
+    pnode->host = e;
+    pnode->host_prev = NULL;
+    pnode->host_next = e->nodes;
+    if (e->nodes != NULL) {
+        e->nodes->host_prev = pnode;
+    }
+    e->nodes = pnode;
+}
 
-  cache_actual_size = 0;
+/*
+ * host_unlink : take a node off its host, dropping the host when it was
+ * the last one, writer lock held
+ */
+static void host_unlink(cache_node *pnode)
+{
+    cache_host *e = pnode->host;
+    if (pnode->host_prev == NULL) {
+        e->nodes = pnode->host_next;
+    } else {
+        pnode->host_prev->host_next = pnode->host_next;
+    }
+    if (pnode->host_next != NULL) {
+        pnode->host_next->host_prev = pnode->host_prev;
+    }
+    if (e->nodes == NULL) {
+        cache_host **pp = &hosts[host_hash(e->name)];
+        while (*pp != e) {
+            pp = &(*pp)->next;
+        }
+        *pp = e->next;
+        Free(e->name);
+        Free(e);
+    }
+}
 
+static cache_list *node_list(cache_node *pnode)
+{
+    return pnode->expires != 0 ? &negatives : &objects;
 }
 
 /*
- * cache_removefromlist : remove some node from list temporally,
- * afterward, the node would add to the last of the list
+ * cache_removefromlist : take a node out of its list
  */
-void cache_removefromlist(cache_node *pnode)
+static void cache_removefromlist(cache_list *l, cache_node *pnode)
 {
-    cache_node *cur = NULL;
-    if (head == tail && head != NULL) {
-        head = NULL;
-        tail = NULL;
-    } else if (pnode->prev == NULL) {
-        cur = head->next;
-        cur->prev = NULL;
-        head = cur;
-    } else if (pnode->next == NULL) {
-        cur = tail->prev;
-        cur->next = NULL;
-        tail = cur;
+    if (pnode->prev == NULL) {
+        l->head = pnode->next;
+    } else {
+        pnode->prev->next = pnode->next;
+    }
+    if (pnode->next == NULL) {
+        l->tail = pnode->prev;
     } else {
-        cur = pnode->next;
-        cache_node *nprev = pnode->prev;
-        nprev->next = cur;
-        cur->prev = nprev;
+        pnode->next->prev = pnode->prev;
     }
-    cache_actual_size -= pnode->size;
 }
 
 /*
  * cache_addlast : add the current node to the last of the list
  */
-void cache_addlast(cache_node *pnode)
+static void cache_addlast(cache_list *l, cache_node *pnode)
 {
-    if (tail == head && head == NULL) {
-        head = pnode;
-        tail = pnode;
-        pnode->next = NULL;
-        pnode->prev = NULL;
+    pnode->next = NULL;
+    pnode->prev = l->tail;
+    if (l->tail == NULL) {
+        l->head = pnode;
     } else {
-        cache_node *curtail = tail;
-        curtail->next = pnode;
-        pnode->prev = curtail;
-        pnode->next = NULL;
-        tail = pnode;
+        l->tail->next = pnode;
     }
-    cache_actual_size += pnode->size;
+    l->tail = pnode;
 }
 
-// cache_deletefirst : remove node and include freeing the memory
-void cache_deletefirst()
+/*
+ * cache_unlink : drop a node from the list and the hash table, writer
+ * lock held. The cache's reference now belongs to the caller.
+ */
+static void cache_unlink(cache_node *pnode)
 {
-    cache_node *cur = head;
-    cache_node *next = NULL;
-    if (tail == NULL) {
-      printf("no cache node!");
-      return;
+    cache_node **pp = &buckets[pnode->hash % CACHE_BUCKETS];
+    while (*pp != pnode) {
+        pp = &(*pp)->hnext;
     }
-    if (head == tail) {
-        head = NULL;
-        tail = NULL;
-    } else {
-        next = cur->next;
-        next->prev = NULL;
-        head = next;
+    *pp = pnode->hnext;
+    cache_list *l = node_list(pnode);
+    cache_removefromlist(l, pnode);
+    l->size -= pnode->size;
+    host_unlink(pnode);
+}
+
+/*
+ * cache_evict : pick the next victim of a list with room for size more
+ * bytes needed, NULL when nothing has to go. Negative entries leave in
+ * insertion order once expired or over budget. Full responses use the
+ * clock algorithm: a node hit since the hand last passed gets a second
+ * chance at the back of the list.
+ */
+static cache_node *cache_evict(cache_list *l, size_t size, time_t now)
+{
+    while (l->head != NULL) {
+        cache_node *victim = l->head;
+        if (l == &negatives) {
+            if (victim->expires > now && l->size + size <= l->limit) {
+                return NULL;
+            }
+        } else if (l->size + size <= l->limit) {
+            return NULL;
+        } else if (__atomic_exchange_n(&victim->referenced, false,
+                                       __ATOMIC_RELAXED)) {
+            cache_removefromlist(l, victim);
+            cache_addlast(l, victim);
+            continue;
+        }
+        cache_unlink(victim);
+        return victim;
+    }
+    return NULL;
+}
+
+/*
+ * cache_get : look up a response and pin it. The node stays valid, even if
+ * it is evicted meanwhile, until the caller hands it back with cache_put.
+ */
+cache_node *cache_get(const char *host, const char *path, const char *port,
+                      http_request *req)
+{
+    unsigned h = cache_hash(host, path, port);
+    reader_lock();
+    cache_node *pnode = cache_search(host, path, port, h, req);
+    if (pnode != NULL) {
+        // readers only flag the hit, the list is reordered by writers
+        __atomic_store_n(&pnode->referenced, true, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pnode->refcnt, 1, __ATOMIC_RELAXED);
     }
-    cache_actual_size -= cur->size;
-    if (cur->cache_key.host != NULL) {
-      Free(cur->cache_key.host);
+    reader_unlock();
+    return pnode;
+}
+
+/*
+ * cache_put : drop a reference, the last one frees the node
+ */
+void cache_put(cache_node *pnode)
+{
+    if (__atomic_sub_fetch(&pnode->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
     }
-    if (cur->cache_key.path != NULL) {
-      Free(cur->cache_key.path);
+    Free(pnode->cache_key.host);
+    Free(pnode->cache_key.path);
+    Free(pnode->cache_key.port);
+    Free(pnode->vary_key);
+    Free(pnode->web_object);
+    Free(pnode);
+}
+
+
+/*
+ * cache_parse_vary : add the fields named by a Vary value to the variant's
+ * mask. User-Agent is skipped, the origin always sees ours. Returns false
+ * for "*" or a field the request block does not keep, either way the
+ * response cannot be reused.
+ */
+static bool cache_parse_vary(cache_node *pnode, http_slice vary)
+{
+    http_slice tok;
+    while (http_next_token(&vary, &tok)) {
+        http_hdr_id id = http_header_id(tok.ptr, tok.len);
+        if (id == HDR_USER_AGENT) {
+            continue;
+        }
+        if (id == HDR_OTHER) {
+            return false;   // "*" lands here too
+        }
+        pnode->vary_mask |= 1u << id;
     }
-    if (cur->cache_key.port != NULL) {
-      Free(cur->cache_key.port);
+    return true;
+}
+
+/*
+ * cache_vary_key : record the request's values of the varied fields,
+ * Accept-Encoding as its mask
+ */
+static void cache_vary_key(cache_node *pnode, http_request *req)
+{
+    unsigned mask = pnode->vary_mask & ~(1u << HDR_ACCEPT_ENCODING);
+    size_t len = 0;
+    int id;
+    if (pnode->vary_mask & (1u << HDR_ACCEPT_ENCODING)) {
+        pnode->accept = cache_accept(req);
     }
-    if (cur->web_object != NULL) {
-      Free(cur->web_object);
+    for (id = 0; id < HDR_COUNT; id++) {
+        if (mask & (1u << id)) {
+            len += req->field[id].len + 2;
+        }
     }
-    if (cur != NULL) {
-      Free(cur);
+    char *key = (char *)Malloc(len + 1);
+    char *dst = key;
+    for (id = 0; id < HDR_COUNT; id++) {
+        if (!(mask & (1u << id))) {
+            continue;
+        }
+        if (req->field[id].ptr == NULL) {
+            *dst++ = '\r';
+        } else {
+            memcpy(dst, req->field[id].ptr, req->field[id].len);
+            dst += req->field[id].len;
+        }
+        *dst++ = '\n';
     }
+    *dst = '\0';
+    pnode->vary_key = key;
+    pnode->vary_len = dst - key;
 }
 
 /*
- * cache_block_create : allocate memory for a cache block and
- * store web_content.
+ * cache_parse : read the status code, header size, validators, coding and
+ * Vary of a stored response. Returns false when the header block is
+ * incomplete, the body is not stored as plain bytes or the response
+ * varies on something we cannot match.
  */
- cache_node *cache_block_create(char *host, char *path, char *port,
-                       char *web_content, size_t size)
- {
-     cache_node *node = (cache_node *)Malloc(sizeof(cache_node));
-     // create web cache key part
-     node->cache_key.host = (char *)Malloc(sizeof(strlen(host) + 1));
-     strncpy(node->cache_key.host, host, strlen(host));
-     node->cache_key.path = (char *)Malloc(sizeof(strlen(path) + 1));
-     strncpy(node->cache_key.path, path, strlen(path));
-     node->cache_key.port = (char *)Malloc(sizeof(strlen(port) + 1));
-     strncpy(node->cache_key.port, port, strlen(port));
+static bool cache_parse(cache_node *pnode)
+{
+    const char *obj = pnode->web_object;
+    const char *end = obj + pnode->size;
+    const char *cur = memchr(obj, '\n', pnode->size);
 
-     // create web content part
-     node->web_object = (char *)Malloc(size + 1);
-     strncpy(node->web_object, web_content, size);
+    if (cur == NULL || cur - obj < 12 || strncmp(obj, "HTTP/1.", 7) != 0
+            || obj[8] != ' ' || !isdigit((unsigned char)obj[9])
+            || !isdigit((unsigned char)obj[10])
+            || !isdigit((unsigned char)obj[11])) {
+        return false;
+    }
+    pnode->status = (obj[9] - '0') * 100 + (obj[10] - '0') * 10
+                    + (obj[11] - '0');
+    cur++;
 
-     node->size = size;
+    http_header hdr;
+    http_hdr_result rc;
+    while ((rc = http_next_header(&cur, end, &hdr)) != HTTP_HDR_END) {
+        if (rc == HTTP_HDR_PARTIAL) {
+            return false;
+        }
+        if (rc != HTTP_HDR_FIELD) {
+            continue;
+        }
+        if (hdr.id == HDR_TRANSFER_ENCODING) {
+            return false;   // the body is framed, slices of it would be wrong
+        }
+        if (hdr.id == HDR_ETAG) {
+            pnode->etag = hdr.value;
+        } else if (hdr.id == HDR_LAST_MODIFIED) {
+            pnode->last_modified = hdr.value;
+        } else if (hdr.id == HDR_CONTENT_ENCODING) {
+            pnode->encoding = http_content_coding(hdr.value);
+        } else if (hdr.id == HDR_VARY && !cache_parse_vary(pnode, hdr.value)) {
+            return false;
+        }
+    }
+    pnode->hdr_size = cur - obj;
+    return true;
+}
 
-     return node;
- }
+/*
+ * cache_release : free unlinked nodes chained through hnext, outside the
+ * lock so hits are only held up while entries are unlinked
+ */
+static size_t cache_release(cache_node *victims)
+{
+    size_t n = 0;
+    while (victims != NULL) {
+        cache_node *old = victims;
+        victims = victims->hnext;
+        cache_put(old);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * cache_negative : is this an answer worth keeping for a short while,
+ * i.e. a missing page, a server error or an empty body?
+ */
+static bool cache_negative(cache_node *pnode)
+{
+    return pnode->status == 404 || pnode->status == 410
+        || (pnode->status >= 500 && pnode->status <= 599)
+        || pnode->status == 204
+        || (pnode->status == 200 && pnode->hdr_size == pnode->size);
+}
+
+/*
+ * cache_insert : store a complete response for host/path/port, fetched
+ * for req. The cache takes web_object over (it must come from Malloc)
+ * when it stores the response, otherwise it stays the caller's. Whole 200
+ * responses are kept until evicted, so partial content never poses as the
+ * full object; error and empty responses only for the negative ttl, in
+ * their own budget. A stored variant with the same coding and Vary values
+ * is replaced, other variants stay. Returns the stored node pinned, to be
+ * released with cache_put, or NULL when the response was not stored.
+ */
+cache_node *cache_insert(const char *host, const char *path,
+                         const char *port, http_request *req,
+                         char *web_object, size_t size)
+{
+    if (size == 0 || size > MAX_OBJECT_SIZE) {
+        return NULL;
+    }
+
+    // everything that can be done without the lock is done up front
+    cache_node *node = (cache_node *)Calloc(1, sizeof(cache_node));
+    node->web_object = web_object;
+    node->size = size;
+    time_t now = time(NULL);
+    bool stored = cache_parse(node);
+    if (stored && cache_negative(node)) {
+        node->expires = now + negative_ttl;
+        stored = negative_ttl > 0 && size <= negatives.limit;
+    } else {
+        stored = stored && node->status == 200;
+    }
+    if (!stored) {
+        Free(node);
+        return NULL;
+    }
+    node->web_object = (char *)Realloc(web_object, size);
+    cache_parse(node);  // re-point the slices into the shrunk copy
+    node->cache_key.host = cache_strdup(host);
+    node->cache_key.path = cache_strdup(path);
+    node->cache_key.port = cache_strdup(port);
+    node->hash = cache_hash(host, path, port);
+    node->refcnt = 2;           // the cache and the caller
+    cache_vary_key(node, req);
+
+    // block the other writer operation on the cache
+    cache_node *victims = NULL;
+    cache_node *old;
+    cache_list *l = node_list(node);
+    P(&w);
+    while ((old = cache_search_variant(node)) != NULL) {
+        cache_unlink(old);      // a fresher copy replaces it
+        old->hnext = victims;
+        victims = old;
+    }
+    while ((old = cache_evict(l, size, now)) != NULL) {
+        old->hnext = victims;
+        victims = old;
+    }
+    cache_addlast(l, node);
+    host_link(node);
+    node->hnext = buckets[node->hash % CACHE_BUCKETS];
+    buckets[node->hash % CACHE_BUCKETS] = node;
+    l->size += size;
+    V(&w);
+
+    // free outside the lock, readers still sending a victim keep it alive
+    cache_release(victims);
+    return node;
+}
+
+/*
+ * cache_purge : drop every variant of host:port/path, or with prefix set
+ * every url of host:port whose path starts with path. An exact url only
+ * visits its hash bucket, a prefix the entries of that host. Returns the
+ * number of entries removed.
+ */
+size_t cache_purge(const char *host, const char *port, const char *path,
+                   bool prefix)
+{
+    cache_node *victims = NULL;
+    cache_node *cur, *next;
+    P(&w);
+    if (!prefix) {
+        unsigned h = cache_hash(host, path, port);
+        for (cur = buckets[h % CACHE_BUCKETS]; cur != NULL; cur = next) {
+            next = cur->hnext;
+            if (key_match(cur, host, path, port, h)) {
+                cache_unlink(cur);
+                cur->hnext = victims;
+                victims = cur;
+            }
+        }
+    } else {
+        size_t pathlen = strlen(path);
+        cache_host *e = host_find(host);
+        for (cur = e != NULL ? e->nodes : NULL; cur != NULL; cur = next) {
+            next = cur->host_next;
+            if (strcmp(cur->cache_key.port, port) == 0
+                    && strncmp(cur->cache_key.path, path, pathlen) == 0) {
+                cache_unlink(cur);  // may free e, next is already saved
+                cur->hnext = victims;
+                victims = cur;
+            }
+        }
+    }
+    V(&w);
+    return cache_release(victims);
+}
+
+/*
+ * cache_purge_host : drop everything cached for host, on any port when
+ * port is NULL
+ */
+size_t cache_purge_host(const char *host, const char *port)
+{
+    cache_node *victims = NULL;
+    P(&w);
+    cache_host *e = host_find(host);
+    cache_node *cur = e != NULL ? e->nodes : NULL;
+    while (cur != NULL) {
+        cache_node *next = cur->host_next;
+        if (port == NULL || strcmp(cur->cache_key.port, port) == 0) {
+            cache_unlink(cur);
+            cur->hnext = victims;
+            victims = cur;
+        }
+        cur = next;
+    }
+    V(&w);
+    return cache_release(victims);
+}
+
+/*
+ * cache_flush : empty the whole cache
+ */
+size_t cache_flush(void)
+{
+    cache_node *victims = NULL;
+    cache_list *lists[2] = { &objects, &negatives };
+    int i;
+    P(&w);
+    for (i = 0; i < 2; i++) {
+        while (lists[i]->head != NULL) {
+            cache_node *cur = lists[i]->head;
+            cache_unlink(cur);
+            cur->hnext = victims;
+            victims = cur;
+        }
+    }
+    V(&w);
+    return cache_release(victims);
+}
@@ -3,19 +3,23 @@
  *  this file is head file for cache.c  :)                                    *
  *              Name: Shu Liu   AndrewID: Shul2                               *
  *  this file defines MAX_CACHE_SIZE, MAX_OBJECT_SIZE, cache node structure   *
- *  and extern some global variables from cache.c                             *
+ *  and the functions used to look up, pin and insert cached responses        *
  *                                                                            *
  */
 #ifndef CACHE_H
 #define CACHE_H
 
 #include "csapp.h"
+#include "http.h"
+#include <stdbool.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+/* separate budget for error and empty responses */
+#define MAX_NEGATIVE_CACHE_SIZE 131072
 
-/* we key structure */
+/* we key structure, several variants of one key may be stored */
 typedef struct web_key{
     char *host;
     char *path;
@@ -25,26 +29,40 @@ typedef struct web_key{
 /* cache node structure */
 typedef struct c_node{
     web_key_t cache_key;
-    char *web_object;
+    char *web_object;           // the whole response: status, headers, body
+    size_t size;                // bytes in web_object
+    size_t hdr_size;            // bytes up to and including the blank line
+    int status;                 // status code of the stored response
+    time_t expires;             // negative entries only, 0 otherwise
+    http_slice etag;            // validators inside web_object, len 0 if none
+    http_slice last_modified;
+    unsigned encoding;          // HTTP_ENC_* bit of the stored body
+    unsigned accept;            // Accept-Encoding mask it was fetched with
+    unsigned vary_mask;         // request fields the origin varies on
+    char *vary_key;             // their values when this variant was fetched
+    size_t vary_len;
+    unsigned hash;
+    int refcnt;                 // one for the cache, one per pinned reader
+    bool referenced;            // hit since the clock hand last passed
     struct c_node *next;
     struct c_node *prev;
-    size_t size;
+    struct c_node *hnext;       // hash chain
+    struct c_node *host_next;   // the other entries of the same host
+    struct c_node *host_prev;
+    struct cache_host *host;
 }cache_node;
 
-// global variables
-extern int readcnt;  // initialized as 0
-extern sem_t mutex, w;   // initialized as 1
-extern cache_node *head;  // the head of the cache list
-extern cache_node *tail;  // the tail of the cache list
-extern size_t cache_actual_size;
-
 // cache out functions that users can access
-void cache_init();
-cache_node *cache_search(char *host, char *path, char *port);
-void cache_removefromlist(cache_node *pnode);
-void cache_addlast(cache_node *pnode);
-void cache_deletefirst();
-cache_node *cache_block_create(char *host, char *path, char *port,
-                      char *web_content, size_t size);
+void cache_init(int negative_ttl);
+cache_node *cache_get(const char *host, const char *path, const char *port,
+                      http_request *req);
+void cache_put(cache_node *pnode);
+cache_node *cache_insert(const char *host, const char *path,
+                         const char *port, http_request *req,
+                         char *web_object, size_t size);
+size_t cache_purge(const char *host, const char *port, const char *path,
+                   bool prefix);
+size_t cache_purge_host(const char *host, const char *port);
+size_t cache_flush(void);
 
 #endif
@@ -6,6 +6,7 @@
 #define __CSAPP_H__
 
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +31,11 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <poll.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 /* $begin createmasks */
@@ -53,6 +59,17 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Scatter-gather output buffer for the Rio package */
+#define RIO_IOVMAX 64
+typedef struct {
+    int rio_fd;                 /* Descriptor the output goes to */
+    int rio_iovcnt;             /* Number of queued pieces */
+    size_t rio_len;             /* Total bytes queued */
+    size_t rio_used;            /* Bytes of rio_buf holding copies */
+    struct iovec rio_iov[RIO_IOVMAX];
+    char rio_buf[RIO_BUFSIZE];  /* Copy space for headers and short lines */
+} rio_wbuf_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */
 extern char **environ; /* Defined by libc */
@@ -144,6 +161,7 @@ void Setsockopt(int s, int level, int optname, const void *optval, int optlen);
 void Bind(int sockfd, struct sockaddr *my_addr, int addrlen);
 void Listen(int s, int backlog);
 int Accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+int Accept_cloexec(int s, struct sockaddr *addr, socklen_t *addrlen);
 void Connect(int sockfd, struct sockaddr *serv_addr, int addrlen);
 
 /* Protocol independent wrappers */
@@ -180,6 +198,15 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_getlineb(rio_t *rp, char **linep);
+void rio_wbufinit(rio_wbuf_t *wp, int fd);
+void rio_wbufadvance(rio_wbuf_t *wp, size_t n);
+ssize_t rio_wbufref(rio_wbuf_t *wp, const void *usrbuf, size_t n);
+ssize_t rio_wbufcopy(rio_wbuf_t *wp, const void *usrbuf, size_t n);
+ssize_t rio_wbufprintf(rio_wbuf_t *wp, const char *fmt, ...);
+ssize_t rio_wbufflush(rio_wbuf_t *wp, int more);
+int rio_cork(int fd, int on);
+ssize_t rio_sendfile(int fd, int srcfd, off_t offset, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -187,14 +214,21 @@ void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_getlineb(rio_t *rp, char **linep);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms);
+int set_sock_timeouts(int fd, int read_ms, int write_ms);
 int open_listenfd(char *port);
+int open_reuseport_listenfd(char *port);
+int pin_cpu(int cpu);
+int accept_cloexec(int listenfd, struct sockaddr *addr, socklen_t *addrlen);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_reuseport_listenfd(char *port);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
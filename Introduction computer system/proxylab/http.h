@@ -0,0 +1,104 @@
+/*                                                                            *
+ *  http.h                                                                    *
+ *  this file is head file for http.c  :)                                     *
+ *  this file defines the header ids we know about, the slice type that       *
+ *  points into a rio_t buffer and the single-pass header tokenizer           *
+ *                                                                            *
+ */
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/* header names the proxy cares about, everything else is HDR_OTHER */
+typedef enum {
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_TRANSFER_ENCODING,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_ETAG,
+    HDR_LAST_MODIFIED,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_DATE,
+    HDR_EXPIRES,
+    HDR_CACHE_CONTROL,
+    HDR_ACCEPT_ENCODING,
+    HDR_CONTENT_ENCODING,
+    HDR_VARY,
+    HDR_PROXY_PEER,
+    HDR_COUNT
+} http_hdr_id;
+
+/* a run of bytes inside somebody else's buffer, never NUL-terminated */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} http_slice;
+
+/* one tokenized header line, all slices point into the scanned buffer */
+typedef struct {
+    http_hdr_id id;
+    http_slice line;     // the raw line, including the trailing CRLF
+    http_slice name;     // field name, without the colon
+    http_slice value;    // field value, surrounding whitespace trimmed
+} http_header;
+
+/* http_next_header results */
+typedef enum {
+    HTTP_HDR_BAD = -2,      // a complete line without a colon
+    HTTP_HDR_PARTIAL = -1,  // no line terminator before the end of input
+    HTTP_HDR_END = 0,       // the empty line that ends the header block
+    HTTP_HDR_FIELD = 1      // a "name: value" line
+} http_hdr_result;
+
+/* content codings as bits, so an Accept-Encoding list becomes a mask;
+ * identity is 0 and always acceptable */
+#define HTTP_ENC_GZIP       0x01
+#define HTTP_ENC_DEFLATE    0x02
+#define HTTP_ENC_BR         0x04
+#define HTTP_ENC_ZSTD       0x08
+#define HTTP_ENC_OTHER      0x80    // unknown codings, or a stack of them
+#define HTTP_ENC_ANY        0xff
+
+/* a client's header block, kept so the cache can consult it before the
+ * request is forwarded. Only well-formed field lines are stored. */
+typedef struct {
+    char buf[MAXBUF];
+    size_t len;
+    http_slice field[HDR_COUNT];    // last value of each known header
+} http_request;
+
+/* http_parse_range results */
+typedef enum {
+    HTTP_RANGE_NONE,            // no usable range, send the whole object
+    HTTP_RANGE_OK,              // one satisfiable byte range
+    HTTP_RANGE_UNSATISFIABLE    // answer 416
+} http_range_result;
+
+const char *http_scan2(const char *p, const char *end, char a, char b);
+http_hdr_result http_next_header(const char **pcur, const char *end,
+                                 http_header *hdr);
+http_hdr_id http_header_id(const char *name, size_t len);
+bool http_slice_eq(http_slice s, const char *str);
+bool http_parse_size(http_slice s, size_t *psize);
+int http_read_request(rio_t *rp, http_request *req);
+http_range_result http_parse_range(http_slice s, size_t size,
+                                   size_t *pfirst, size_t *plast);
+bool http_if_range_match(http_slice cond, http_slice etag,
+                         http_slice last_modified);
+bool http_parse_date(http_slice s, time_t *pt);
+bool http_etag_list_match(http_slice list, http_slice etag);
+bool http_next_token(http_slice *plist, http_slice *ptok);
+unsigned http_content_coding(http_slice s);
+unsigned http_accept_encoding(http_slice s);
+
+#endif
@@ -0,0 +1,225 @@
+/*                                                                            *
+ *  origin.c                                                                  *
+ *  this file keeps one slow origin from starving the others  . :)            *
+ *  every (host, port) gets at most per_origin fetches in flight. extra       *
+ *  requests wait in that origin's FIFO, and a full FIFO is refused so the    *
+ *  caller can answer 503. when a global cap is set, a freed slot goes to     *
+ *  the next origin in a round-robin ring of origins with waiters, so a busy  *
+ *  origin cannot win every slot                                              *
+ *                                                                            *
+ */
+#include "origin.h"
+#include <strings.h>
+#include <stdbool.h>
+
+#define ORIGIN_BUCKETS 256
+
+/* a thread parked in an origin's queue */
+typedef struct waiter {
+    sem_t ready;            // posted once a slot has been handed over
+    struct waiter *next;
+} waiter_t;
+
+struct origin {
+    char *host;
+    char *port;
+    int inflight;           // fetches running against this origin
+    int queued;             // threads waiting in qhead..qtail
+    waiter_t *qhead;
+    waiter_t *qtail;
+    bool in_ring;
+    struct origin *hnext;   // hash chain
+    struct origin *rnext;   // round-robin ring of origins with waiters
+    struct origin *rprev;
+};
+
+static origin_t *buckets[ORIGIN_BUCKETS];
+static origin_t *ring_cursor;   // origin that gets the next free global slot
+static int per_origin_limit;
+static int queue_limit;
+static int total_limit;         // 0: no global cap
+static int total_inflight;
+static sem_t origin_mutex;
+
+/*
+ * origin_init : set the limits, call once before any origin_acquire
+ */
+void origin_init(int per_origin, int queue_max, int total)
+{
+    Sem_init(&origin_mutex, 0, 1);
+    per_origin_limit = per_origin;
+    queue_limit = queue_max;
+    total_limit = total;
+}
+
+static unsigned origin_hash(const char *host, const char *port)
+{
+    unsigned h = 5381;
+    for (; *host; host++) {
+        h = h * 33 + (unsigned char)(*host | 0x20);
+    }
+    for (; *port; port++) {
+        h = h * 33 + (unsigned char)*port;
+    }
+    return h % ORIGIN_BUCKETS;
+}
+
+/*
+ * origin_lookup : find or create the entry for host:port, mutex held
+ */
+static origin_t *origin_lookup(const char *host, const char *port)
+{
+    unsigned b = origin_hash(host, port);
+    origin_t *o;
+    for (o = buckets[b]; o != NULL; o = o->hnext) {
+        if (strcasecmp(o->host, host) == 0 && strcmp(o->port, port) == 0) {
+            return o;
+        }
+    }
+    o = (origin_t *)Calloc(1, sizeof(origin_t));
+    o->host = (char *)Malloc(strlen(host) + 1);
+    strcpy(o->host, host);
+    o->port = (char *)Malloc(strlen(port) + 1);
+    strcpy(o->port, port);
+    o->hnext = buckets[b];
+    buckets[b] = o;
+    return o;
+}
+
+/*
+ * origin_forget : drop an idle entry so the table only holds live origins
+ */
+static void origin_forget(origin_t *o)
+{
+    origin_t **pp = &buckets[origin_hash(o->host, o->port)];
+    while (*pp != o) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = o->hnext;
+    Free(o->host);
+    Free(o->port);
+    Free(o);
+}
+
+static void ring_insert(origin_t *o)
+{
+    if (ring_cursor == NULL) {
+        o->rnext = o->rprev = o;
+        ring_cursor = o;
+    } else {
+        // join just behind the cursor, i.e. last in this round
+        o->rnext = ring_cursor;
+        o->rprev = ring_cursor->rprev;
+        o->rprev->rnext = o;
+        ring_cursor->rprev = o;
+    }
+    o->in_ring = true;
+}
+
+static void ring_remove(origin_t *o)
+{
+    if (o->rnext == o) {
+        ring_cursor = NULL;
+    } else {
+        o->rprev->rnext = o->rnext;
+        o->rnext->rprev = o->rprev;
+        if (ring_cursor == o) {
+            ring_cursor = o->rnext;
+        }
+    }
+    o->in_ring = false;
+}
+
+/*
+ * dispatch : hand free slots to waiters, one origin at a time in ring
+ * order, skipping origins that are at their own limit. mutex held.
+ */
+static void dispatch(void)
+{
+    while (ring_cursor != NULL
+            && (total_limit == 0 || total_inflight < total_limit)) {
+        origin_t *start = ring_cursor;
+        origin_t *o = start;
+        while (o->inflight >= per_origin_limit) {
+            o = o->rnext;
+            if (o == start) {
+                return;     // every waiting origin is at its own limit
+            }
+        }
+
+        waiter_t *w = o->qhead;
+        o->qhead = w->next;
+        if (o->qhead == NULL) {
+            o->qtail = NULL;
+        }
+        o->queued--;
+        o->inflight++;
+        total_inflight++;
+
+        ring_cursor = o->rnext;
+        if (o->queued == 0) {
+            ring_remove(o);
+        }
+        V(&w->ready);
+    }
+}
+
+/*
+ * origin_acquire : take a fetch slot for host:port, waiting in the
+ * origin's FIFO if needed. Returns NULL right away when that FIFO is
+ * full; the caller should shed the request.
+ */
+origin_t *origin_acquire(const char *host, const char *port)
+{
+    P(&origin_mutex);
+    origin_t *o = origin_lookup(host, port);
+
+    if (o->queued == 0 && o->inflight < per_origin_limit
+            && (total_limit == 0 || total_inflight < total_limit)) {
+        o->inflight++;
+        total_inflight++;
+        V(&origin_mutex);
+        return o;
+    }
+    if (o->queued >= queue_limit) {
+        if (o->inflight == 0 && o->queued == 0) {
+            origin_forget(o);
+        }
+        V(&origin_mutex);
+        return NULL;
+    }
+
+    waiter_t w;
+    Sem_init(&w.ready, 0, 0);
+    w.next = NULL;
+    if (o->qtail == NULL) {
+        o->qhead = &w;
+    } else {
+        o->qtail->next = &w;
+    }
+    o->qtail = &w;
+    o->queued++;
+    if (!o->in_ring) {
+        ring_insert(o);
+    }
+    V(&origin_mutex);
+
+    P(&w.ready);    // dispatch() has already counted us in
+    sem_destroy(&w.ready);
+    return o;
+}
+
+/*
+ * origin_release : give the slot back and wake whoever is next
+ */
+void origin_release(origin_t *o)
+{
+    P(&origin_mutex);
+    o->inflight--;
+    total_inflight--;
+    dispatch();
+    if (o->inflight == 0 && o->queued == 0) {
+        origin_forget(o);
+    }
+    V(&origin_mutex);
+}
@@ -0,0 +1,20 @@
+/*                                                                            *
+ *  origin.h                                                                  *
+ *  this file is head file for origin.c  :)                                   *
+ *  per-(host, port) admission for upstream fetches: a cap on concurrent      *
+ *  fetches per origin, a bounded FIFO of waiters behind it, and an optional  *
+ *  global cap that is handed out round-robin across origins                  *
+ *                                                                            *
+ */
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include "csapp.h"
+
+typedef struct origin origin_t;
+
+void origin_init(int per_origin, int queue_limit, int total);
+origin_t *origin_acquire(const char *host, const char *port);
+void origin_release(origin_t *o);
+
+#endif
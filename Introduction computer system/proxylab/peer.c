@@ -0,0 +1,178 @@
+/*                                                                            *
+ *  peer.c                                                                    *
+ *  this file routes cache misses to the sibling that owns them  . :)         *
+ *  every peer is placed on a 32-bit ring at PEER_VNODES points, a url        *
+ *  belongs to the first point at or after its own hash. adding or losing     *
+ *  a peer only moves the urls next to its points, and a peer that refused    *
+ *  a connection is skipped for PEER_RETRY seconds                            *
+ *                                                                            *
+ */
+#include "peer.h"
+#include <time.h>
+
+#define PEER_VNODES 100
+#define PEER_RETRY 5
+#define PEER_MAX 64
+
+typedef struct {
+    unsigned hash;
+    peer_t *peer;
+} vnode_t;
+
+static peer_t peers[PEER_MAX];
+static int npeers;
+static vnode_t *ring;
+static int nvnodes;
+static char self_name[MAXLINE];
+
+/*
+ * ring_hash : FNV-1a with a murmur3 finalizer, so similar names such as
+ * "host:8001#1" and "host:8001#2" still land far apart
+ */
+static unsigned ring_hash(const char *s, unsigned h)
+{
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int vnode_cmp(const void *a, const void *b)
+{
+    unsigned x = ((const vnode_t *)a)->hash;
+    unsigned y = ((const vnode_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * peer_add : split "host:port" into a new ring member
+ */
+static bool peer_add(const char *name, size_t len)
+{
+    char buf[MAXLINE];
+    if (len == 0 || len >= sizeof(buf) || npeers == PEER_MAX) {
+        return false;
+    }
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    char *colon = strrchr(buf, ':');
+    if (colon == NULL || colon == buf || colon[1] == '\0') {
+        return false;
+    }
+    *colon = '\0';
+    peers[npeers].host = strdup(buf);
+    peers[npeers].port = strdup(colon + 1);
+    peers[npeers].self = strlen(self_name) == len
+                         && strncmp(name, self_name, len) == 0;
+    npeers++;
+    return true;
+}
+
+/*
+ * peer_init : build the ring from a comma separated "host:port" list.
+ * self names this proxy as it appears in the list; it is added when the
+ * list leaves it out. Returns false on a malformed list or without self,
+ * since a ring we are not part of would forward every url to a sibling.
+ */
+bool peer_init(const char *list, const char *self)
+{
+    int i, v;
+    bool listed = false;
+
+    if (self == NULL || strlen(self) >= sizeof(self_name)) {
+        return false;
+    }
+    strcpy(self_name, self);
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        if (!peer_add(list, len)) {
+            return false;
+        }
+        listed |= peers[npeers - 1].self;
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    if (!listed && !peer_add(self, strlen(self))) {
+        return false;
+    }
+
+    ring = (vnode_t *)Malloc(npeers * PEER_VNODES * sizeof(vnode_t));
+    for (i = 0; i < npeers; i++) {
+        char name[MAXLINE];
+        for (v = 0; v < PEER_VNODES; v++) {
+            snprintf(name, sizeof(name), "%s:%s#%d",
+                     peers[i].host, peers[i].port, v);
+            ring[nvnodes].hash = ring_hash(name, 2166136261u);
+            ring[nvnodes].peer = &peers[i];
+            nvnodes++;
+        }
+    }
+    qsort(ring, nvnodes, sizeof(vnode_t), vnode_cmp);
+    return true;
+}
+
+/*
+ * peer_owner : the sibling to ask for host:port/path, or NULL when the
+ * url is ours, there is no ring, or its owner is marked down
+ */
+peer_t *peer_owner(const char *host, const char *port, const char *path)
+{
+    if (nvnodes == 0) {
+        return NULL;
+    }
+
+    // hash the url the way the cache keys it, host folded to lower case
+    char key[MAXLINE];
+    size_t i, hostlen = strlen(host);
+    if (hostlen >= sizeof(key)) {
+        return NULL;
+    }
+    for (i = 0; i < hostlen; i++) {
+        key[i] = tolower((unsigned char)host[i]);
+    }
+    key[hostlen] = '\0';
+    unsigned h = ring_hash(path, ring_hash(port, ring_hash(key, 2166136261u)));
+
+    // first point at or after h, wrapping around
+    int lo = 0, hi = nvnodes;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    peer_t *owner = ring[lo == nvnodes ? 0 : lo].peer;
+    if (owner->self
+            || __atomic_load_n(&owner->down_until, __ATOMIC_RELAXED)
+               > time(NULL)) {
+        return NULL;
+    }
+    return owner;
+}
+
+/*
+ * peer_failed : stop asking a sibling that could not be reached for a while
+ */
+void peer_failed(peer_t *peer)
+{
+    __atomic_store_n(&peer->down_until, time(NULL) + PEER_RETRY,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * peer_self : how we introduce ourselves in PEER_HEADER
+ */
+const char *peer_self(void)
+{
+    return self_name[0] != '\0' ? self_name : "proxy";
+}
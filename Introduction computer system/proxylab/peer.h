@@ -0,0 +1,29 @@
+/*                                                                            *
+ *  peer.h                                                                    *
+ *  this file is head file for peer.c  :)                                     *
+ *  a consistent-hash ring of sibling proxies, each url is owned by one of    *
+ *  them so a cluster of proxies caches every object once                     *
+ *                                                                            *
+ */
+#ifndef PEER_H
+#define PEER_H
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/* header that marks a request sent by a sibling, it is never forwarded */
+#define PEER_HEADER "X-Proxy-Peer"
+
+typedef struct peer {
+    char *host;
+    char *port;
+    bool self;              // this entry is us
+    time_t down_until;      // skipped until then after a failed connect
+} peer_t;
+
+bool peer_init(const char *list, const char *self);
+peer_t *peer_owner(const char *host, const char *port, const char *path);
+void peer_failed(peer_t *peer);
+const char *peer_self(void);
+
+#endif
@@ -0,0 +1,297 @@
+/*                                                                            *
+ *  prefetch.c                                                                *
+ *  this file prefetches the links of cached html pages  . :)                 *
+ *  src= and href= values of a text/html 200 are resolved against the page,   *
+ *  and same-origin paths without a query go into a queue of at most budget   *
+ *  urls. PREFETCH_WORKERS threads drain it; when the queue is full further   *
+ *  links are simply dropped, prefetching never holds up a client             *
+ *                                                                            *
+ */
+#include "prefetch.h"
+#include "http.h"
+#include <strings.h>
+
+#define PREFETCH_WORKERS 2
+#define PREFETCH_PER_PAGE 16    // links taken from a single page
+#define PREFETCH_HOSTLEN 256
+#define PREFETCH_PORTLEN 8
+
+typedef struct {
+    char host[PREFETCH_HOSTLEN];
+    char port[PREFETCH_PORTLEN];
+    char path[MAXLINE];
+} prefetch_job;
+
+static prefetch_job *queue;     // ring of budget jobs
+static int queue_size;
+static int front, count;
+static sem_t queue_mutex;
+static sem_t items;             // jobs waiting in the ring
+static prefetch_fn fetch_url;
+
+/* Thread routine, fetches queued urls one after another */
+static void *prefetch_thread(void *vargp)
+{
+    (void)vargp;
+    pthread_detach(pthread_self());
+    prefetch_job job;
+    while (1) {
+        P(&items);
+        P(&queue_mutex);
+        job = queue[front];
+        front = (front + 1) % queue_size;
+        count--;
+        V(&queue_mutex);
+        fetch_url(job.host, job.port, job.path);
+    }
+    return NULL;
+}
+
+/*
+ * prefetch_init : allow up to budget queued urls, 0 leaves prefetching off
+ */
+void prefetch_init(int budget, prefetch_fn fetch)
+{
+    int i;
+    pthread_t tid;
+    if (budget <= 0) {
+        return;
+    }
+    queue = (prefetch_job *)Calloc(budget, sizeof(prefetch_job));
+    queue_size = budget;
+    fetch_url = fetch;
+    Sem_init(&queue_mutex, 0, 1);
+    Sem_init(&items, 0, 0);
+    for (i = 0; i < PREFETCH_WORKERS; i++) {
+        Pthread_create(&tid, NULL, prefetch_thread, NULL);
+    }
+}
+
+bool prefetch_enabled(void)
+{
+    return queue_size > 0;
+}
+
+/*
+ * prefetch_push : queue a url unless it is queued already or the queue is
+ * full. Returns false when full.
+ */
+static bool prefetch_push(const char *host, const char *port,
+                          const char *path)
+{
+    int i;
+    bool queued = true;
+    P(&queue_mutex);
+    for (i = 0; i < count; i++) {
+        prefetch_job *job = &queue[(front + i) % queue_size];
+        if (strcmp(job->path, path) == 0 && strcmp(job->port, port) == 0
+                && strcasecmp(job->host, host) == 0) {
+            V(&queue_mutex);
+            return true;
+        }
+    }
+    if (count == queue_size) {
+        queued = false;
+    } else {
+        prefetch_job *job = &queue[(front + count) % queue_size];
+        strcpy(job->host, host);
+        strcpy(job->port, port);
+        strcpy(job->path, path);
+        count++;
+    }
+    V(&queue_mutex);
+    if (queued) {
+        V(&items);
+    }
+    return queued;
+}
+
+/*
+ * prefetch_url : queue one url for the cache, such as the whole object
+ * behind a range the proxy relayed. Returns false when prefetching is off
+ * or the queue is full.
+ */
+bool prefetch_url(const char *host, const char *port, const char *path)
+{
+    if (!prefetch_enabled() || strlen(host) >= PREFETCH_HOSTLEN
+            || strlen(port) >= PREFETCH_PORTLEN || strlen(path) >= MAXLINE) {
+        return false;
+    }
+    return prefetch_push(host, port, path);
+}
+
+/*
+ * resolve_link : turn a link found on host:port/page into a path on the
+ * same origin. Returns false for other origins, queries, fragments only,
+ * non-http schemes and anything with "..".
+ */
+static bool resolve_link(const char *host, const char *port, const char *page,
+                         const char *link, size_t len, char *path)
+{
+    const char *hash = memchr(link, '#', len);
+    if (hash != NULL) {
+        len = hash - link;
+    }
+    if (len == 0 || memchr(link, '?', len) != NULL) {
+        return false;
+    }
+
+    if (len > 7 && strncasecmp(link, "http://", 7) == 0) {
+        // absolute, only our own host and port
+        const char *auth = link + 7;
+        size_t authlen = 0;
+        size_t hostlen = strlen(host);
+        while (authlen < len - 7 && auth[authlen] != '/') {
+            authlen++;
+        }
+        if (authlen < hostlen
+                || strncasecmp(auth, host, hostlen) != 0) {
+            return false;
+        }
+        if (authlen == hostlen ? strcmp(port, "80") != 0
+                : auth[hostlen] != ':'
+                  || authlen - hostlen - 1 != strlen(port)
+                  || strncmp(auth + hostlen + 1, port, strlen(port)) != 0) {
+            return false;
+        }
+        link = auth + authlen;
+        len -= 7 + authlen;
+        if (len == 0) {
+            link = "/";
+            len = 1;
+        }
+    } else if (memchr(link, ':', len) != NULL
+               || (len > 1 && link[0] == '/' && link[1] == '/')) {
+        return false;   // mailto:, javascript:, https:, //other.host
+    }
+
+    size_t dirlen = 0;
+    if (link[0] != '/') {
+        // relative to the page's directory
+        const char *query = strchr(page, '?');
+        size_t pagelen = query != NULL ? (size_t)(query - page)
+                                       : strlen(page);
+        while (pagelen > 0 && page[pagelen - 1] != '/') {
+            pagelen--;
+        }
+        dirlen = pagelen;
+    }
+    if (dirlen + len >= MAXLINE) {
+        return false;
+    }
+    memcpy(path, page, dirlen);
+    memcpy(path + dirlen, link, len);
+    path[dirlen + len] = '\0';
+    if (path[0] != '/' || strstr(path, "..") != NULL
+            || strpbrk(path, " \t\r\n") != NULL) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * attr_value : if p starts a src= or href= attribute, return its value
+ */
+static const char *attr_value(const char *p, const char *end, size_t *plen)
+{
+    size_t n;
+    if (end - p > 4 && strncasecmp(p, "src", 3) == 0) {
+        n = 3;
+    } else if (end - p > 5 && strncasecmp(p, "href", 4) == 0) {
+        n = 4;
+    } else {
+        return NULL;
+    }
+    p += n;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    if (p == end || *p++ != '=') {
+        return NULL;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p == end) {
+        return NULL;
+    }
+    const char *value = p;
+    const char *close;
+    if (*p == '"' || *p == '\'') {
+        value = p + 1;
+        close = memchr(value, *p, end - value);
+    } else {
+        for (close = value; close < end && *close != ' ' && *close != '>'
+                && *close != '\t' && *close != '\n'; close++) {
+        }
+    }
+    if (close == NULL) {
+        return NULL;
+    }
+    *plen = close - value;
+    return value;
+}
+
+/*
+ * prefetch_scan : queue the same-origin links of a response that was
+ * just fetched for host:port/path, if it is an uncompressed html 200
+ */
+void prefetch_scan(const char *host, const char *port, const char *path,
+                   const char *response, size_t size)
+{
+    if (!prefetch_enabled() || size < 12
+            || strncmp(response + 8, " 200", 4) != 0
+            || strlen(host) >= PREFETCH_HOSTLEN
+            || strlen(port) >= PREFETCH_PORTLEN) {
+        return;
+    }
+
+    const char *cur = memchr(response, '\n', size);
+    const char *end = response + size;
+    bool html = false;
+    http_header hdr;
+    http_hdr_result rc;
+    if (cur == NULL) {
+        return;
+    }
+    cur++;
+    while ((rc = http_next_header(&cur, end, &hdr)) != HTTP_HDR_END) {
+        if (rc == HTTP_HDR_PARTIAL) {
+            return;
+        }
+        if (rc != HTTP_HDR_FIELD) {
+            continue;
+        }
+        if (hdr.id == HDR_CONTENT_TYPE) {
+            html = hdr.value.len >= 9
+                   && strncasecmp(hdr.value.ptr, "text/html", 9) == 0;
+        } else if (hdr.id == HDR_CONTENT_ENCODING
+                   && http_content_coding(hdr.value) != 0) {
+            return;
+        }
+    }
+    if (!html) {
+        return;
+    }
+
+    // attribute names follow whitespace inside a tag
+    int found = 0;
+    char link[MAXLINE];
+    const char *p;
+    for (p = cur; p < end && found < PREFETCH_PER_PAGE; p++) {
+        if (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+            continue;
+        }
+        size_t len;
+        const char *value = attr_value(p + 1, end, &len);
+        if (value == NULL
+                || !resolve_link(host, port, path, value, len, link)
+                || strcmp(link, path) == 0) {
+            continue;
+        }
+        found++;
+        if (!prefetch_push(host, port, link)) {
+            break;  // over budget
+        }
+    }
+}
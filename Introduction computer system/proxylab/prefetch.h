@@ -0,0 +1,23 @@
+/*                                                                            *
+ *  prefetch.h                                                                *
+ *  this file is head file for prefetch.c  :)                                 *
+ *  warms the cache with the same-origin resources an html page links to,     *
+ *  through a bounded queue served by background threads                      *
+ *                                                                            *
+ */
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/* fetches one url into the cache, supplied by the proxy */
+typedef void (*prefetch_fn)(char *host, char *port, char *path);
+
+void prefetch_init(int budget, prefetch_fn fetch);
+bool prefetch_enabled(void);
+void prefetch_scan(const char *host, const char *port, const char *path,
+                   const char *response, size_t size);
+bool prefetch_url(const char *host, const char *port, const char *path);
+
+#endif
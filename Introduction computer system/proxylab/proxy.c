@@ -11,9 +11,17 @@
 #include <strings.h>
 #include <stdbool.h>
 #include "cache.h"
+#include "http.h"
+#include "uring.h"
+#include "origin.h"
+#include "tunnel.h"
+#include "peer.h"
+#include "admin.h"
+#include "prefetch.h"
 
 #define HOSTLEN 256
 #define SERVLEN 8
+#define ACCEPT_BACKOFF_MS 100   // pause after accept runs out of fds
 
 static const char *header_user_agent = "Mozilla/5.0"
                                     " (X11; Linux x86_64; rv:45.0)"
@@ -42,7 +50,33 @@ typedef enum {
 } process_result;
 
 void serve(client_info *client, int connfd);
-char content_buffer[MAX_OBJECT_SIZE];
+void serve_connect(int connfd, rio_t *prio, char *authority);
+void serve_cached(int fd, cache_node *pnode, http_request *req,
+                  bool head_only);
+char *listen_port;    // port every acceptor listens on
+
+// deadlines in milliseconds, 0 means wait forever
+int connect_timeout_ms = 5000;
+int read_timeout_ms = 30000;
+int write_timeout_ms = 30000;
+
+// admission control: one slot per request being served
+int max_inflight = 256;
+sem_t inflight_slots;
+
+// upstream fairness: fetches per origin, waiters per origin, and an
+// optional cap on all upstream fetches (0 = none)
+int origin_limit = 32;
+int origin_queue = 64;
+int upstream_limit = 0;
+
+// seconds an error or empty response is served from the cache, 0 = never
+int negative_ttl = 10;
+
+// urls the link prefetcher may have queued, 0 = no prefetching, and
+// where its fetches send the response they would give a client
+int prefetch_budget = 0;
+int prefetch_sink = -1;
 
 /*
  * parse_uri - parse URI into filename and CGI args
@@ -65,57 +99,51 @@ parse_result parse_uri(char *uri, char *phost, char *ppath, char *pport) {
     }
 
     // fetch the host name from uri
-    // bool res = checkstartwith(uri, "http://");
     if (strncasecmp(uri, "http://", 7) != 0) {
       printf("host name error!\n");
       return PARSE_ERROR;
     }
 
-    char *curindex = uri + 7;
-    char *endindex;
-    if ((endindex = strpbrk(curindex, " :/\r\n\0")) == NULL) {
+    // one pass over the uri: host runs up to ':' or '/', the port up to
+    // '/', and the path is whatever is left
+    char *cur = uri + 7;
+    size_t hostlen = strcspn(cur, ":/");
+    if (hostlen == 0 || hostlen >= MAXLINE) {
       printf("host name parse error!\n");
       return PARSE_ERROR;
     }
-    printf("in parse uri, the curindex is %s, endindex is %s\n",
-              curindex, endindex);
-    strncpy(phost, curindex, endindex - curindex);
-    phost[endindex - curindex] = '\0';
-    printf("int parse uri, phost is %s\n", phost);
+    memcpy(phost, cur, hostlen);
+    phost[hostlen] = '\0';
+    cur += hostlen;
 
     // fetch the port from uri
-    // char portStr[MAXLINE];
-    if (*endindex == ':') {
-        //portStr = strcpy(portStr, endindex + 1);
-        char *portCur = endindex + 1;
-        while (*portCur >= '0' && *portCur <= '9') {
-            *pport = *portCur;
-            pport++;
-            portCur++;
+    if (*cur == ':') {
+        cur++;
+        size_t portlen = strspn(cur, "0123456789");
+        if (portlen == 0 || portlen >= SERVLEN) {
+            printf("port parse error!\n");
+            return PARSE_ERROR;
         }
-        printf("port is %s\n", pport);
+        memcpy(pport, cur, portlen);
+        pport[portlen] = '\0';
+        cur += portlen;
     } else {
         strcpy(pport, "80");  // default port number
-        //*pport = 80;
     }
 
-    // get the path from uri
-    char *pathbegin;
-    char pathStr[MAXLINE];
-    if ((pathbegin = strchr(curindex, '/')) == NULL) {
-        // find the empty directory
-        pathStr[0] = '\0';
+    // get the path from uri, an empty path is the root directory
+    if (*cur == '\0') {
+        strcpy(ppath, "/");
+    } else if (*cur == '/') {
+        size_t pathlen = strlen(cur);
+        if (pathlen >= MAXLINE) {
+            return PARSE_ERROR;
+        }
+        memcpy(ppath, cur, pathlen + 1);
     } else {
-        // find the directory
-	      pathbegin++;
-	      strcpy(pathStr, pathbegin);
-        printf("pathStr is %s\n", pathStr);
+        return PARSE_ERROR;
     }
 
-    ppath[0] = '/';
-    strcpy(ppath+1, pathStr);
-    printf("ppath is %s\n", ppath);
-
     return PARSE_SUCCESS;
 }
 
@@ -156,15 +184,13 @@ void clienterror(int fd, char *cause, char *errnum,
         return; // Overflow!
     }
 
-    /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing error response headers to client\n");
-        return;
-    }
-
-    /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
-        fprintf(stderr, "Error writing error response body to client\n");
+    /* Write headers and body together */
+    rio_wbuf_t out;
+    rio_wbufinit(&out, fd);
+    rio_wbufref(&out, buf, buflen);
+    rio_wbufref(&out, body, bodylen);
+    if (rio_wbufflush(&out, 0) < 0) {
+        fprintf(stderr, "Error writing error response to client\n");
         return;
     }
 }
@@ -172,145 +198,224 @@ void clienterror(int fd, char *cause, char *errnum,
 
 /*
  * send_request: send http request to the web server, should create client file
- * descriptor first, and initialized afterward
+ * descriptor first, and initialized afterward. The client's headers were
+ * read into req: User-Agent, Connection, Proxy-Connection and Keep-Alive
+ * are replaced by our own, everything else is forwarded verbatim. With a
+ * peer the request goes to that sibling proxy instead, with an absolute
+ * URI and PEER_HEADER so the sibling fetches it itself.
  */
-process_result send_request(int *pclientfd, rio_t *prioclient, rio_t *prio,
-                char *host, char *port, char *method, char *path)
+process_result send_request(int *pclientfd, rio_t *prioclient,
+                http_request *req, char *host, char *port,
+                char *method, char *path, peer_t *peer)
 {
   int clientfd = 0;
-  // Open socket connection to server
-  if ((clientfd = open_clientfd(host, port)) < 0) {
-      fprintf(stderr, "Error connecting to %s:%s\n", host, port);
+  char *dial_host = peer != NULL ? peer->host : host;
+  char *dial_port = peer != NULL ? peer->port : port;
+  // Open socket connection to server, a dead origin costs at most the
+  // connect deadline and a stalled one the read/write deadlines
+  if ((clientfd = open_clientfd_timeout(dial_host, dial_port,
+                                        connect_timeout_ms)) < 0) {
+      int err = errno;
+      fprintf(stderr, "Error connecting to %s:%s\n", dial_host, dial_port);
+      errno = err;
       return PROCESS_ERROR;
   }
+  set_sock_timeouts(clientfd, read_timeout_ms, write_timeout_ms);
 
   // Initialize RIO read structure for server
   rio_readinitb(prioclient, clientfd);
 
+  // the whole request is batched and goes out in one sendmsg
+  rio_wbuf_t out;
+  rio_wbufinit(&out, clientfd);
+
   // first request line
-  char buftemp[MAXLINE];
-  sprintf(buftemp, "%s %s HTTP/1.0\r\n", method, path);
-  rio_writen(clientfd, buftemp, strlen(buftemp));
-  printf("the buf is %s\n", buftemp);
-
-  // read other lines of request
-  while(rio_readlineb(prio, buftemp, MAXLINE) > 2) {
-      if (strstr(buftemp, "User-Agent")) {
-          char userAg[MAXLINE];
-          strcpy(userAg, "User-Agent: ");
-          strcpy(userAg+12, header_user_agent);
-          //strcpy(userAg+12+strlen(header_user_agent), "\r\n");
-          strncpy(buftemp, userAg, strlen(userAg));
-      }
-      else if (strstr(buftemp, "Proxy-Connection")) {
-          strcpy(buftemp, "Proxy-Connection: close\r\n");
-      }
-      else if (strstr(buftemp, "Connection")) {
-          strcpy(buftemp, "Connection: close\r\n");
+  if (peer != NULL) {
+      rio_wbufprintf(&out, "%s http://%s:%s%s HTTP/1.0\r\n",
+                     method, host, port, path);
+  } else {
+      rio_wbufprintf(&out, "%s %s HTTP/1.0\r\n", method, path);
+  }
+
+  // the client's header lines, runs of forwarded lines go out uncopied
+  http_header hdr;
+  const char *cur = req->buf;
+  const char *end = req->buf + req->len;
+  const char *run = cur;
+  while (http_next_header(&cur, end, &hdr) == HTTP_HDR_FIELD) {
+      switch (hdr.id) {
+      case HDR_USER_AGENT:
+      case HDR_CONNECTION:
+      case HDR_PROXY_CONNECTION:
+      case HDR_KEEP_ALIVE:
+      case HDR_PROXY_PEER:
+          rio_wbufref(&out, run, hdr.line.ptr - run);
+          run = cur;
+          break;
+      default:
+          break;
       }
-      printf("header within client: %s\n", buftemp);
-      rio_writen(clientfd, buftemp, strlen(buftemp));
   }
-  rio_writen(clientfd, "\r\n", 2);
+  rio_wbufref(&out, run, end - run);
+
+  // the headers every proxied request carries
+  if (req->field[HDR_HOST].ptr == NULL) {
+      rio_wbufprintf(&out, "Host: %s:%s\r\n", host, port);
+  }
+  if (peer != NULL) {
+      rio_wbufprintf(&out, PEER_HEADER ": %s\r\n", peer_self());
+  }
+  rio_wbufprintf(&out,
+          "User-Agent: %s\r\n" \
+          "Connection: close\r\n" \
+          "Proxy-Connection: close\r\n\r\n", \
+          header_user_agent);
+  if (rio_wbufflush(&out, 0) < 0) {
+      int err = errno;
+      fprintf(stderr, "Error sending request to %s:%s\n",
+              dial_host, dial_port);
+      errno = err;
+      *pclientfd = clientfd;
+      return PROCESS_ERROR;
+  }
   *pclientfd = clientfd;
   return SEND_SUCCESS;
 }
 
 /*
  * receive_content: receive http response from the server and send back to
- * client, we try to search the content-length first and then read message
- * respectively
+ * client. The status line, headers and body are gathered in webbuf, so a
+ * response that fits in the cache goes to the client with a single writev
+ * and webbuf holds exactly what was sent. Bigger bodies stream in MAXBUF
+ * pieces once webbuf is full. *psize is the total response size either way.
+ * Answers to HEAD, and 204 and 304 answers, end with their headers.
  */
 process_result receive_content(int fd, rio_t *prioclient,
-                                      char *webbuf, size_t *psize)
+                                      char *webbuf, size_t *psize,
+                                      bool head_only)
 {
-
   size_t length = 0;
   bool flag = false;
-  // read the response from server
-  char buf[MAXLINE];
-  char *cur = webbuf;
   size_t total_size = 0;
-  int size = 0;
-  while ((size = rio_readlineb(prioclient, buf, MAXLINE)) > 2)
-  {
-      char *result = NULL;
-      if ((result = strstr(buf, "Content-Length")) != NULL)
-      {
-          flag = true;
-          result += 16;
-          length = atoi(result);
+  size_t hdr_size = 0;
+  ssize_t size = 0;
+  rio_wbuf_t out;
+  rio_wbufinit(&out, fd);
+
+  // status line, nothing has reached the client yet so a failure here
+  // can still be reported properly
+  char *line;
+  if ((size = rio_getlineb(prioclient, &line)) <= 0) {
+      if (size < 0 && errno == EAGAIN) {
+          clienterror(fd, "upstream", "504", "Gateway Timeout",
+                  "The origin server did not answer in time");
+      } else {
+          clienterror(fd, "upstream", "502", "Bad Gateway",
+                  "The origin server sent no response");
       }
-      // send message to the client
-      // total_size += size;
-      // if (total_size < MAX_OBJECT_SIZE) {
-      //     memcpy(cur, buf, size);
-      //     cur += size;
-      // }
-      Rio_writen(fd, buf, size);
+      return PROCESS_ERROR;
   }
 
-  Rio_writen(fd, "\r\n", 2);
-
-  // send body of the message to the web client
-  char bodyMsg[MAXLINE];
-
-  if (!flag)
-  {
-      printf("no content_length\n");
-      size = 0;
-      cur = webbuf;
-      while ((size = rio_readnb(prioclient, bodyMsg, MAXLINE)) > 0) {
-          printf("size is %d\n", size);
-          total_size += size;
-          if (total_size < MAX_OBJECT_SIZE) {
-              printf("copy size is %d\n", size);
-              memcpy(cur, bodyMsg, size);
-              cur += size;
-          }
-          Rio_writen(fd, bodyMsg, strlen(bodyMsg));
+  http_header hdr;
+  http_hdr_result rc = HTTP_HDR_FIELD;
+  do {
+      if (hdr_size + size + 2 > MAX_OBJECT_SIZE) {
+          clienterror(fd, "upstream", "502", "Bad Gateway",
+                  "The origin server sent oversized headers");
+          return PROCESS_ERROR;
       }
-      printf("no length, size is %zu\n", total_size);
-      *psize = total_size;
-      return RECEIVE_SUCCESS;
-  }
-
-  // have content length
-  size = 0;
-  cur = webbuf;
-  printf("have content_length\n");
-  printf("content length : %zu\n", length);
-  while (length > 0)
+      memcpy(webbuf + hdr_size, line, size);
+      hdr_size += size;
+      if ((size = rio_getlineb(prioclient, &line)) <= 0) {
+          clienterror(fd, "upstream", "502", "Bad Gateway",
+                  "The origin server sent a truncated response");
+          return PROCESS_ERROR;
+      }
+      const char *pos = line;
+      rc = http_next_header(&pos, line + size, &hdr);
+      if (rc == HTTP_HDR_FIELD && hdr.id == HDR_CONTENT_LENGTH) {
+          flag = http_parse_size(hdr.value, &length);
+      }
+  } while (rc != HTTP_HDR_END);
+  memcpy(webbuf + hdr_size, "\r\n", 2);
+  hdr_size += 2;
+  total_size = hdr_size;
+  rio_wbufref(&out, webbuf, hdr_size);
+
+  // body: without a content length read until the server closes
+  char bodyMsg[MAXBUF];
+  int relay = 0;    // io_uring relay buffer for the next read
+  bool bodyless = head_only || (hdr_size > 12
+          && (strncmp(webbuf + 8, " 204", 4) == 0
+              || strncmp(webbuf + 8, " 304", 4) == 0));
+  size_t remaining = bodyless ? 0 : flag ? length : (size_t) -1;
+  while (remaining > 0)
   {
-      int readlength = 0;
-      if (length > MAXLINE) {
-          readlength = MAXLINE;
+      char *dst = bodyMsg;
+      size_t want = MAXBUF;
+      bool batched = false;
+      if (total_size < MAX_OBJECT_SIZE) {
+          // still filling the cache buffer, keep batching
+          dst = webbuf + total_size;
+          want = MAX_OBJECT_SIZE - total_size;
+      } else if (uring_enabled() && prioclient->rio_cnt <= 0
+                 && (dst = uring_relay_buf(relay)) != NULL) {
+          // write what is queued and read the next piece in one submission,
+          // alternating relay buffers so the two never overlap
+          relay = (relay + 1) % URING_RELAY_BUFS;
+          batched = true;
+      } else if (rio_wbufflush(&out, 1) < 0) {
+          fprintf(stderr, "Error writing response to client\n");
+          return PROCESS_ERROR;
       } else {
-          readlength = length;
+          dst = bodyMsg;
       }
-
-      if ((size = rio_readnb(prioclient, bodyMsg, readlength)) == readlength) {
-          total_size += size;
-          if (total_size < MAX_OBJECT_SIZE) {
-              memcpy(cur, bodyMsg, size);
-              cur += size;
-          }
-          rio_writen(fd, bodyMsg, size);
-          length -= readlength;
+      if (want > remaining) {
+          want = remaining;
       }
-      else {
-          fprintf(stderr, "read from server error\n");
 
-          if (prioclient->rio_fd > 0) {
-            Close(prioclient->rio_fd);
+      if (batched) {
+          ssize_t written;
+          size = uring_writev_read(fd, out.rio_iov, out.rio_iovcnt, &written,
+                                   write_timeout_ms, prioclient->rio_fd,
+                                   dst, want, read_timeout_ms);
+          // a failed or timed out write ends the relay right away, a
+          // final flush would only wait for the deadline again
+          if (written < 0) {
+              fprintf(stderr, "Error writing response to client\n");
+              return PROCESS_ERROR;
           }
-          if (fd > 0) {
-            Close(fd);
+          rio_wbufadvance(&out, written);
+          if (out.rio_iovcnt > 0 && rio_wbufflush(&out, 1) < 0) {
+              fprintf(stderr, "Error writing response to client\n");
+              return PROCESS_ERROR;
           }
+      } else {
+          size = rio_readnb(prioclient, dst, want);
+      }
+      if (size < 0) {
+          fprintf(stderr, "read from server error\n");
           return PROCESS_ERROR;
       }
+      if (size == 0) {
+          break;    // EOF
+      }
+      rio_wbufref(&out, dst, size);
+      total_size += size;
+      remaining -= size;
+      if (!batched && (size_t) size < want) {
+          break;    // EOF
+      }
+  }
+
+  if (rio_wbufflush(&out, 0) < 0) {
+      fprintf(stderr, "Error writing response to client\n");
+      return PROCESS_ERROR;
+  }
+  if (!bodyless && flag && total_size - hdr_size != length) {
+      fprintf(stderr, "read from server error\n");
+      return PROCESS_ERROR;
   }
-  printf("total size is %zu\n", total_size);
   *psize = total_size;
   return RECEIVE_SUCCESS;
 }
@@ -325,6 +430,181 @@ void closefd(int fd)
   }
 }
 
+/*
+ * serve_connect : handle "CONNECT host:port". The request headers are
+ * skipped, the origin is dialed, and after the 200 the bytes are relayed
+ * both ways with splice() until either side is done or the tunnel has
+ * been idle for the read deadline.
+ */
+void serve_connect(int connfd, rio_t *prio, char *authority)
+{
+    char host[MAXLINE], port[SERVLEN];
+    char *colon = strrchr(authority, ':');
+    size_t hostlen = colon == NULL ? 0 : (size_t)(colon - authority);
+    size_t portlen = colon == NULL ? 0 : strlen(colon + 1);
+
+    if (hostlen == 0 || hostlen >= MAXLINE || portlen == 0
+            || portlen >= SERVLEN
+            || strspn(colon + 1, "0123456789") != portlen) {
+        clienterror(connfd, authority, "400", "Bad Request",
+                "CONNECT needs a host:port target");
+        return;
+    }
+    memcpy(host, authority, hostlen);
+    host[hostlen] = '\0';
+    memcpy(port, colon + 1, portlen + 1);
+
+    // the request headers carry nothing we need
+    char *line;
+    ssize_t n;
+    while ((n = rio_getlineb(prio, &line)) > 0) {
+        if ((n == 2 && line[0] == '\r' && line[1] == '\n')
+                || (n == 1 && line[0] == '\n')) {
+            break;
+        }
+    }
+    if (n <= 0) {
+        return;
+    }
+
+    int serverfd = open_clientfd_timeout(host, port, connect_timeout_ms);
+    if (serverfd < 0) {
+        if (errno == ETIMEDOUT) {
+            clienterror(connfd, authority, "504", "Gateway Timeout",
+                    "Could not reach the origin server in time");
+        } else {
+            clienterror(connfd, authority, "502", "Bad Gateway",
+                    "Could not reach the origin server");
+        }
+        return;
+    }
+
+    static const char established[] =
+            "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if (rio_writen(connfd, (void *)established, sizeof(established) - 1) < 0
+            // the client may already have sent its TLS hello
+            || (prio->rio_cnt > 0
+                && rio_writen(serverfd, prio->rio_bufptr, prio->rio_cnt) < 0)) {
+        Close(serverfd);
+        return;
+    }
+    prio->rio_cnt = 0;
+
+    tunnel_relay(connfd, serverfd, read_timeout_ms);
+    Close(serverfd);
+}
+
+/*
+ * keep_entity : every stored header except the length of the full body
+ */
+static bool keep_entity(http_hdr_id id)
+{
+    return id != HDR_CONTENT_LENGTH;
+}
+
+/*
+ * keep_validators : the headers a 304 repeats (RFC 7232 section 4.1)
+ */
+static bool keep_validators(http_hdr_id id)
+{
+    return id == HDR_ETAG || id == HDR_LAST_MODIFIED || id == HDR_DATE
+        || id == HDR_EXPIRES || id == HDR_CACHE_CONTROL || id == HDR_VARY;
+}
+
+/*
+ * queue_headers : queue the stored header lines that keep() accepts,
+ * without the status line and the final blank line. Runs of kept lines
+ * are queued straight from the node.
+ */
+static void queue_headers(rio_wbuf_t *out, cache_node *pnode,
+                          bool (*keep)(http_hdr_id))
+{
+    const char *end = pnode->web_object + pnode->hdr_size;
+    const char *cur = memchr(pnode->web_object, '\n', pnode->hdr_size) + 1;
+    const char *run = cur;
+    http_header hdr;
+    while (http_next_header(&cur, end, &hdr) != HTTP_HDR_END) {
+        if (!keep(hdr.id)) {
+            rio_wbufref(out, run, hdr.line.ptr - run);
+            run = cur;
+        }
+    }
+    rio_wbufref(out, run, hdr.line.ptr - run);
+}
+
+/*
+ * not_modified : do the client's validators still match the stored
+ * response? If-None-Match wins over If-Modified-Since when both are sent.
+ */
+static bool not_modified(cache_node *pnode, http_request *req)
+{
+    time_t since, modified;
+    if (req->field[HDR_IF_NONE_MATCH].ptr != NULL) {
+        return http_etag_list_match(req->field[HDR_IF_NONE_MATCH],
+                                    pnode->etag);
+    }
+    return req->field[HDR_IF_MODIFIED_SINCE].ptr != NULL
+        && http_parse_date(req->field[HDR_IF_MODIFIED_SINCE], &since)
+        && http_parse_date(pnode->last_modified, &modified)
+        && modified <= since;
+}
+
+/*
+ * serve_cached : answer from a pinned cache node. Matching validators get
+ * a 304 and HEAD the stored headers, neither touches the body. Otherwise
+ * a single satisfiable Range, still current according to If-Range, gets
+ * a 206 slice of the stored body, an unsatisfiable one a 416 and anything
+ * else the whole stored response. Stored error answers are replayed as
+ * they are, validators and ranges only apply to a 200.
+ */
+void serve_cached(int fd, cache_node *pnode, http_request *req,
+                  bool head_only)
+{
+    const char *body = pnode->web_object + pnode->hdr_size;
+    size_t body_size = pnode->size - pnode->hdr_size;
+    size_t first = 0, last = 0;
+    http_range_result range = HTTP_RANGE_NONE;
+
+    bool ok = pnode->status == 200;
+    if (ok && !head_only && req->field[HDR_RANGE].ptr != NULL
+            && (req->field[HDR_IF_RANGE].ptr == NULL
+                || http_if_range_match(req->field[HDR_IF_RANGE],
+                                       pnode->etag, pnode->last_modified))) {
+        range = http_parse_range(req->field[HDR_RANGE], body_size,
+                                 &first, &last);
+    }
+
+    rio_wbuf_t out;
+    rio_wbufinit(&out, fd);
+    if (ok && not_modified(pnode, req)) {
+        rio_wbufprintf(&out, "HTTP/1.0 304 Not Modified\r\n");
+        queue_headers(&out, pnode, keep_validators);
+        rio_wbufcopy(&out, "\r\n", 2);
+    } else if (head_only) {
+        rio_wbufref(&out, pnode->web_object, pnode->hdr_size);
+    } else if (range == HTTP_RANGE_NONE) {
+        rio_wbufref(&out, pnode->web_object, pnode->size);
+    } else if (range == HTTP_RANGE_UNSATISFIABLE) {
+        rio_wbufprintf(&out,
+                "HTTP/1.0 416 Range Not Satisfiable\r\n" \
+                "Content-Range: bytes */%zu\r\n" \
+                "Content-Length: 0\r\n\r\n", \
+                body_size);
+    } else {
+        // the stored headers go out as they are, except the length
+        rio_wbufprintf(&out, "HTTP/1.0 206 Partial Content\r\n");
+        queue_headers(&out, pnode, keep_entity);
+        rio_wbufprintf(&out,
+                "Content-Range: bytes %zu-%zu/%zu\r\n" \
+                "Content-Length: %zu\r\n\r\n", \
+                first, last, body_size, last - first + 1);
+        rio_wbufref(&out, body + first, last - first + 1);
+    }
+    if (rio_wbufflush(&out, 0) < 0) {
+        fprintf(stderr, "Error writing cached response to client\n");
+    }
+}
+
 /* Thread routine */
 void *thread(void *vargp)
 {
@@ -338,16 +618,60 @@ void *thread(void *vargp)
     // free the client_info
     Free(pclient);
 
+    // a client that stops reading or writing only holds us this long
+    set_sock_timeouts(connfd, read_timeout_ms, write_timeout_ms);
+
     // serve functions
     serve(&localclient, connfd);
 
     // important, close file descriptor
     printf("close file descriptor %d\n", connfd);
     Close(connfd);
+
+    // give back the admission slot taken in accept_loop
+    V(&inflight_slots);
     return NULL;
 }
 
 
+/*
+ * range_fits : is response a 206 whose Content-Range says the full object
+ * would fit in the cache? The length after the slash is the whole body.
+ */
+static bool range_fits(const char *response, size_t size)
+{
+    if (size < 12 || strncmp(response + 8, " 206", 4) != 0) {
+        return false;
+    }
+    const char *cur = memchr(response, '\n', size);
+    const char *end = response + size;
+    http_header hdr;
+    http_hdr_result rc;
+    if (cur == NULL) {
+        return false;
+    }
+    cur++;
+    while ((rc = http_next_header(&cur, end, &hdr)) != HTTP_HDR_END) {
+        if (rc == HTTP_HDR_PARTIAL) {
+            return false;
+        }
+        if (rc != HTTP_HDR_FIELD
+                || !http_slice_eq(hdr.name, "Content-Range")) {
+            continue;
+        }
+        const char *slash = memchr(hdr.value.ptr, '/', hdr.value.len);
+        http_slice total;
+        size_t length;
+        if (slash == NULL) {
+            return false;
+        }
+        total.ptr = slash + 1;
+        total.len = hdr.value.ptr + hdr.value.len - total.ptr;
+        return http_parse_size(total, &length) && length <= MAX_OBJECT_SIZE;
+    }
+    return false;
+}
+
 /*
  * serve - handle one HTTP request/response transaction
  * reference tiny.c
@@ -356,10 +680,19 @@ void serve(client_info *client, int connfd) {
     // Get some extra info about the client (hostname/port)
     // This is optional, but it's nice to know who's connected
 
-    Getnameinfo((SA *) &client->addr, client->addrlen,
+    if (client->addrlen == 0) {
+        // io_uring's multishot accept does not report the peer
+        client->addrlen = sizeof(client->addr);
+        getpeername(connfd, (SA *) &client->addr, &client->addrlen);
+    }
+    // numeric only, a reverse DNS lookup would stall the request
+    if (getnameinfo((SA *) &client->addr, client->addrlen,
             client->host, sizeof(client->host),
             client->serv, sizeof(client->serv),
-            0);
+            NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        strcpy(client->host, "?");
+        strcpy(client->serv, "?");
+    }
     printf("Accepted connection from %s:%s\n", client->host, client->serv);
 
     int fd = connfd;
@@ -389,14 +722,21 @@ void serve(client_info *client, int connfd) {
         return;
     }
 
-    /* Check that the method is GET */
-    if (strncmp(method, "GET", sizeof("GET"))) {
+    /* CONNECT opens a tunnel, usually for HTTPS */
+    if (strcmp(method, "CONNECT") == 0) {
+        serve_connect(connfd, &rio, uri);
+        return;
+    }
+
+    /* Check that the method is GET or HEAD */
+    bool head_only = strcmp(method, "HEAD") == 0;
+    if (strcmp(method, "GET") != 0 && !head_only) {
         clienterror(connfd, method, "501", "Not Implemented",
                 "Tiny does not implement this method");
         return;
     }
 
-    /* Parse URI from GET request */
+    /* Parse URI from the request */
     char host[MAXLINE], path[MAXLINE], port[MAXLINE];
 
     parse_result result = parse_uri(uri, host, path, port);
@@ -406,76 +746,117 @@ void serve(client_info *client, int connfd) {
         return;
     }
 
-    // step 2 :search the cache block
-    // 2.1 lock the readcnt, and allow all the reader when first in
-    P(&mutex);
-    readcnt++;
-    if (readcnt == 1) {    // first in
-        P(&w);
+    // step 2 : read the request headers, the cache needs Range & co.
+    http_request req;
+    int rc = http_read_request(&rio, &req);
+    if (rc == -2) {
+        clienterror(connfd, "headers", "431",
+                "Request Header Fields Too Large",
+                "The request headers do not fit in the proxy's buffer");
+        return;
     }
-    V(&mutex);
-
-    /* reading happens here */
-    cache_node *pnode = NULL;
-    if ((pnode = cache_search(host, path, port)) != NULL) {
-        // cache hit
-        cache_removefromlist(pnode);   // remove node from the list
-        cache_addlast(pnode);    //  add it to the last position
-
-        // send back to the client immediatelly
-        printf("web object size is %zu\n", pnode->size);
-        rio_writen(fd, pnode->web_object, pnode->size);
+    if (rc < 0) {
         return;
     }
 
-
-    P(&mutex);
-    readcnt--;
-    if (readcnt == 0) {  // last out
-      V(&w);
+    // step 2.1 : search the cache block, the node stays pinned while we
+    // write from it
+    cache_node *pnode = cache_get(host, path, port, &req);
+    if (pnode != NULL) {
+        printf("web object size is %zu\n", pnode->size);
+        serve_cached(fd, pnode, &req, head_only);
+        cache_put(pnode);
+        return;
     }
-    V(&mutex);
 
 
-    // step 3 : send http requrest
+    // step 3 : in peer mode the sibling that owns this url is asked
+    // first, unless a sibling is already asking us. If it cannot be
+    // reached we go to the origin ourselves.
     int clientfd = 0;
     rio_t rioclient;
     process_result res;
-    res = send_request(&clientfd, &rioclient, &rio, host, port, method, path);
-    if (res == PROCESS_ERROR) {
-        printf("malformed requrest");
+    peer_t *peer = NULL;
+    if (req.field[HDR_PROXY_PEER].ptr == NULL) {
+        peer = peer_owner(host, port, path);
+    }
+    if (peer != NULL) {
+        res = send_request(&clientfd, &rioclient, &req, host, port,
+                           method, path, peer);
+        if (res == PROCESS_ERROR) {
+            peer_failed(peer);
+            closefd(clientfd);
+            clientfd = 0;
+            peer = NULL;
+        }
+    }
+
+    // step 3.1 : wait for a fetch slot for this origin, so a slow origin
+    // only ties up its own share of the threads
+    origin_t *origin = NULL;
+    if (peer == NULL && (origin = origin_acquire(host, port)) == NULL) {
+        clienterror(fd, host, "503", "Service Unavailable",
+                "Too many requests are waiting for this origin");
+        return;
+    }
+
+    // step 3.2 : send http requrest
+    if (origin != NULL) {
+        res = send_request(&clientfd, &rioclient, &req, host, port,
+                           method, path, NULL);
+    }
+    if (origin != NULL && res == PROCESS_ERROR) {
+        origin_release(origin);
+        if (errno == ETIMEDOUT || errno == EAGAIN) {
+            clienterror(fd, host, "504", "Gateway Timeout",
+                    "Could not reach the origin server in time");
+        } else {
+            clienterror(fd, host, "502", "Bad Gateway",
+                    "Could not reach the origin server");
+        }
         closefd(clientfd);
         return;
     }
     printf("client fd is %d\n", clientfd);
 
-    // step 4 : receive message
+    // step 4 : receive message, each request has its own buffer
     size_t content_size = 0;
-    res = receive_content(fd, &rioclient, content_buffer, &content_size);
+    char *content_buffer = (char *)Malloc(MAX_OBJECT_SIZE);
+    res = receive_content(fd, &rioclient, content_buffer, &content_size,
+                          head_only);
+    if (origin != NULL) {
+        origin_release(origin);
+    }
     if (res == PROCESS_ERROR) {
         printf("malformed requrest");
+        Free(content_buffer);
         closefd(clientfd);
         return;
     }
 
-    // step 5: write cache block
-    if (content_size <= MAX_OBJECT_SIZE) {
+    // step 4.1 : queue the links of an html page while we still own it
+    if (content_size <= MAX_OBJECT_SIZE && !head_only && peer == NULL) {
+        prefetch_scan(host, port, path, content_buffer, content_size);
+    }
 
-        // block the other writer operation on the cache
-        P(&w);
-        cache_actual_size += content_size;
-        while (cache_actual_size > MAX_CACHE_SIZE) {
-            printf("total size is %zu\n", cache_actual_size);
-            cache_deletefirst();
+    // step 5: write cache block, the cache keeps content_buffer unless
+    // the response is partial, an error or too big. A HEAD answer has no
+    // body, so it is never stored, and what a sibling sent us stays
+    // cached at the sibling only. A 206 of an object that would fit
+    // queues the whole object for the prefetcher, so later ranges of it
+    // are cut from the cache.
+    pnode = NULL;
+    if (content_size <= MAX_OBJECT_SIZE && !head_only && peer == NULL) {
+        pnode = cache_insert(host, path, port, &req, content_buffer,
+                             content_size);
+        if (pnode == NULL && range_fits(content_buffer, content_size)) {
+            prefetch_url(host, port, path);
         }
-
-        // create new cache block
-        cache_node *newnode = cache_block_create(host, path, port,
-                                content_buffer, content_size);
-        printf("after create new cache!\n");
-        cache_addlast(newnode);
-
-        V(&w);
+    }
+    if (pnode != NULL) {
+        cache_put(pnode);
+    } else {
+        Free(content_buffer);
     }
 
     // step 6: finish
@@ -485,40 +866,264 @@ void serve(client_info *client, int connfd) {
     return;
 }
 
+/*
+ * prefetch_fetch : bring one url into the cache for the prefetcher. It is
+ * skipped when cached already or owned by a sibling, and the response a
+ * client would get goes to /dev/null.
+ */
+void prefetch_fetch(char *host, char *port, char *path)
+{
+    http_request req;
+    req.len = 0;
+    memset(req.field, 0, sizeof(req.field));
+
+    cache_node *pnode = cache_get(host, path, port, &req);
+    if (pnode != NULL) {
+        cache_put(pnode);
+        return;
+    }
+    if (peer_owner(host, port, path) != NULL) {
+        return;
+    }
+    origin_t *origin = origin_acquire(host, port);
+    if (origin == NULL) {
+        return;
+    }
+
+    int clientfd = 0;
+    rio_t rioclient;
+    if (send_request(&clientfd, &rioclient, &req, host, port, "GET", path,
+                     NULL) == SEND_SUCCESS) {
+        size_t size = 0;
+        char *buf = (char *)Malloc(MAX_OBJECT_SIZE);
+        cache_node *pnode = NULL;
+        if (receive_content(prefetch_sink, &rioclient, buf, &size,
+                            false) == RECEIVE_SUCCESS
+                && size <= MAX_OBJECT_SIZE) {
+            pnode = cache_insert(host, path, port, &req, buf, size);
+        }
+        if (pnode != NULL) {
+            cache_put(pnode);
+        } else {
+            Free(buf);
+        }
+    }
+    origin_release(origin);
+    closefd(clientfd);
+}
+
+/*
+ * shed : turn a connection away with 503 without spending a thread on it.
+ * Whatever part of the request already arrived is drained first so the
+ * close does not turn into a reset that hides the response. This runs on
+ * the accept thread, so nothing here may wait: the short answer fits in
+ * the empty send buffer of a new socket and is sent with MSG_DONTWAIT.
+ */
+void shed(int connfd)
+{
+    static const char overloaded[] =
+        "HTTP/1.0 503 Service Unavailable\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: 43\r\n"
+        "Connection: close\r\n\r\n"
+        "The proxy is overloaded, try again later.\r\n";
+    char buf[MAXBUF];
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    if (send(connfd, overloaded, sizeof(overloaded) - 1, MSG_DONTWAIT) < 0) {
+        fprintf(stderr, "shed: %s\n", strerror(errno));
+    }
+    Close(connfd);
+}
+
+/*
+ * accept_loop : accept connections on listenfd forever, one thread each
+ */
+void accept_loop(int listenfd)
+{
+  pthread_t tid;
+
+  while (1) {
+      /* Allocate space on the stack for client info */
+      // client_info client_data;
+      client_info *client = (client_info *)Malloc(sizeof(client_info));
+
+      /* accept() will block until a client connects to the port */
+      if (uring_enabled()) {
+          client->addrlen = 0;
+          client->connfd = uring_accept(listenfd);
+      } else {
+          /* Initialize the length of the address */
+          client->addrlen = sizeof(client->addr);
+          client->connfd = accept(listenfd,
+                  (SA *) &client->addr, &client->addrlen);
+      }
+
+      /* Overload must not kill the proxy: only a broken listening socket
+         is fatal, running out of descriptors or memory is waited out */
+      if (client->connfd < 0) {
+          int err = errno;
+          Free(client);
+          if (err == EINTR || err == ECONNABORTED) {
+              continue;
+          }
+          if (err == EBADF || err == EINVAL || err == ENOTSOCK) {
+              errno = err;
+              unix_error("Accept error");
+          }
+          fprintf(stderr, "accept error: %s\n", strerror(err));
+          poll(NULL, 0, ACCEPT_BACKOFF_MS);
+          continue;
+      }
+
+      /* Over capacity: answer 503 right away instead of queueing */
+      if (sem_trywait(&inflight_slots) < 0) {
+          shed(client->connfd);
+          Free(client);
+          continue;
+      }
+
+      /* Connection is established; serve client */
+      // serve(client);
+      if (pthread_create(&tid, NULL, thread, client) != 0) {
+          shed(client->connfd);
+          Free(client);
+          V(&inflight_slots);
+      }
+  }
+}
+
+/* Acceptor thread routine, vargp carries the acceptor's index */
+void *acceptor(void *vargp)
+{
+    int index = (int)(long)vargp;
+
+    // every acceptor owns a SO_REUSEPORT socket and one core
+    int listenfd = Open_reuseport_listenfd(listen_port);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0 && pin_cpu(index % ncpu) < 0) {
+        fprintf(stderr, "acceptor %d: pin_cpu failed: %s\n",
+                index, strerror(errno));
+    }
+    accept_loop(listenfd);
+    return NULL;
+}
+
 int main(int argc, char **argv) {
 
   int listenfd;
-  pthread_t tid;
+  bool use_uring = false;
+  int acceptors = 1;
+  int opt;
   Signal(SIGPIPE, SIG_IGN);
 
   /* Check command line args */
-  if (argc != 2) {
-      fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  char *peers = NULL;
+  char *self = NULL;
+  char *admin_path = NULL;
+  while ((opt = getopt(argc, argv, "ua:c:r:w:m:o:q:t:p:s:n:A:f:")) != -1) {
+      switch (opt) {
+      case 'u':
+          use_uring = true;
+          break;
+      case 'a':
+          acceptors = atoi(optarg);
+          break;
+      case 'c':
+          connect_timeout_ms = atoi(optarg);
+          break;
+      case 'r':
+          read_timeout_ms = atoi(optarg);
+          break;
+      case 'w':
+          write_timeout_ms = atoi(optarg);
+          break;
+      case 'm':
+          max_inflight = atoi(optarg);
+          break;
+      case 'o':
+          origin_limit = atoi(optarg);
+          break;
+      case 'q':
+          origin_queue = atoi(optarg);
+          break;
+      case 't':
+          upstream_limit = atoi(optarg);
+          break;
+      case 'p':
+          peers = optarg;
+          break;
+      case 's':
+          self = optarg;
+          break;
+      case 'n':
+          negative_ttl = atoi(optarg);
+          break;
+      case 'A':
+          admin_path = optarg;
+          break;
+      case 'f':
+          prefetch_budget = atoi(optarg);
+          break;
+      default:
+          optind = argc;
+          break;
+      }
+  }
+  if (optind != argc - 1 || acceptors < 1 || max_inflight < 1
+          || origin_limit < 1 || origin_queue < 0 || upstream_limit < 0
+          || negative_ttl < 0 || prefetch_budget < 0
+          || (peers != NULL && !peer_init(peers, self))) {
+      // without -s no ring member is us, so every url would be forwarded
+      // to some sibling, including back to this proxy
+      if (peers != NULL && self == NULL) {
+          fprintf(stderr, "%s: -p needs -s to name this proxy\n", argv[0]);
+      }
+      fprintf(stderr, "usage: %s [-u] [-a acceptors] [-c connect_ms]"
+              " [-r read_ms] [-w write_ms] [-m max_inflight]"
+              " [-o per_origin] [-q origin_queue] [-t upstream_total]"
+              " [-p host:port,... -s self_host:port] [-n negative_ttl]"
+              " [-A admin_socket] [-f prefetch_budget]"
+              " <port>\n", argv[0]);
       return 0;
   }
+  listen_port = argv[optind];
 
   // initialize the cache system
-  cache_init();
+  cache_init(negative_ttl);
+  Sem_init(&inflight_slots, 0, max_inflight);
+  origin_init(origin_limit, origin_queue, upstream_limit);
 
-  if ((listenfd = Open_listenfd(argv[1])) < 0) {
-      fprintf(stderr, "Error input!\n");
+  // local purge/flush commands, see admin.c
+  if (admin_path != NULL && !admin_start(admin_path)) {
       return 0;
   }
 
-  while (1) {
-      /* Allocate space on the stack for client info */
-      // client_info client_data;
-      client_info *client = (client_info *)Malloc(sizeof(client_info));
+  // background link prefetching, see prefetch.c
+  if (prefetch_budget > 0) {
+      prefetch_sink = Open("/dev/null", O_WRONLY, 0);
+      prefetch_init(prefetch_budget, prefetch_fetch);
+  }
 
-      /* Initialize the length of the address */
-      client->addrlen = sizeof(client->addr);
+  // optional io_uring backend, falls back to plain syscalls
+  if (use_uring) {
+      uring_init(64);
+  }
 
-      /* Accept() will block until a client connects to the port */
-      client->connfd = Accept(listenfd,
-              (SA *) &client->addr, &client->addrlen);
+  if (acceptors > 1) {
+      // N listening sockets on the same port, the kernel balances them
+      int i;
+      pthread_t tid;
+      for (i = 0; i < acceptors; i++) {
+          Pthread_create(&tid, NULL, acceptor, (void *)(long)i);
+      }
+      Pthread_exit(NULL);
+  }
 
-      /* Connection is established; serve client */
-      // serve(client);
-      pthread_create(&tid, NULL, thread, client);
+  if ((listenfd = Open_listenfd(listen_port)) < 0) {
+      fprintf(stderr, "Error input!\n");
+      return 0;
   }
+  accept_loop(listenfd);
+  return 0;
 }
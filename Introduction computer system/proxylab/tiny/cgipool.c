@@ -0,0 +1,272 @@
+/*
+ * cgipool.c - per-program pools of persistent CGI workers.
+ *
+ * Only programs named with CGIPOOL_SUFFIX are pooled, so a plain CGI is
+ * never run with an empty QUERY_STRING just to see whether it answers.
+ * The first request for such a program spawns a worker and waits briefly
+ * for the protocol magic. A program that does not answer with it is
+ * marked plain and never spawned into the pool again. Otherwise up to
+ * max_workers workers are kept per program; a request takes an idle one,
+ * or spawns one while below the limit, or waits for one to come back.
+ * A worker that fails a round trip is killed, and the request falls back
+ * to running the program in the caller. Workers are reaped by the reaper
+ * thread, which tells us through cgipool_reaped; an idle worker that died
+ * is dropped right away instead of failing the next request.
+ */
+#include "cgipool.h"
+#include "cgispawn.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HANDSHAKE_TIMEOUT_MS 1000
+
+typedef enum {
+    PROG_UNKNOWN,       // no worker has answered yet
+    PROG_POOLED,        // speaks the protocol
+    PROG_PLAIN          // plain CGI, spawned for every request
+} prog_kind;
+
+typedef struct cgi_worker {
+    pid_t pid;                  // 0 once the process has exited
+    int fd;                     // our end of the socketpair
+    bool idle;
+    struct cgi_prog *prog;
+    struct cgi_worker *next;    // idle list
+    struct cgi_worker *wnext;   // every live worker
+    struct cgi_worker *wprev;
+} cgi_worker;
+
+typedef struct cgi_prog {
+    char *path;
+    prog_kind kind;
+    cgi_worker *idle;
+    sem_t slots;                // idle or not yet spawned workers
+    struct cgi_prog *next;
+} cgi_prog;
+
+static cgi_prog *progs;
+static cgi_worker *workers;
+static int max_workers;         // per program, 0: pool disabled
+static sem_t mutex;             // protects everything above
+
+void cgipool_init(int workers) {
+    Sem_init(&mutex, 0, 1);
+    max_workers = workers;
+}
+
+/*
+ * find_prog - look up, or add, the pool for path. mutex held.
+ */
+static cgi_prog *find_prog(const char *path) {
+    cgi_prog *p;
+    for (p = progs; p != NULL; p = p->next) {
+        if (strcmp(p->path, path) == 0) {
+            return p;
+        }
+    }
+    p = Calloc(1, sizeof(cgi_prog));
+    p->path = Malloc(strlen(path) + 1);
+    strcpy(p->path, path);
+    p->kind = PROG_UNKNOWN;
+    Sem_init(&p->slots, 0, max_workers);
+    p->next = progs;
+    progs = p;
+    return p;
+}
+
+static void worker_unlink(cgi_worker *w) {
+    if (w->wprev) {
+        w->wprev->wnext = w->wnext;
+    } else {
+        workers = w->wnext;
+    }
+    if (w->wnext) {
+        w->wnext->wprev = w->wprev;
+    }
+}
+
+/*
+ * kill_worker - get rid of a busy worker. The reaper collects the process.
+ */
+static void kill_worker(cgi_worker *w) {
+    P(&mutex);
+    worker_unlink(w);
+    if (w->pid > 0) {   // not reaped yet, so the pid is still ours
+        kill(w->pid, SIGKILL);
+    }
+    V(&mutex);
+    Close(w->fd);
+    Free(w);
+}
+
+/*
+ * cgipool_reaped - reaper hook, called while the exited pid is a zombie
+ */
+void cgipool_reaped(pid_t pid) {
+    cgi_worker *w, **pp;
+
+    P(&mutex);
+    for (w = workers; w != NULL && w->pid != pid; w = w->wnext) {
+        ;
+    }
+    if (w == NULL) {
+        V(&mutex);
+        return;         // not a pool worker
+    }
+    w->pid = 0;
+    if (!w->idle) {
+        V(&mutex);
+        return;         // its user will notice and call kill_worker
+    }
+    for (pp = &w->prog->idle; *pp != w; pp = &(*pp)->next) {
+        ;
+    }
+    *pp = w->next;
+    worker_unlink(w);
+    V(&mutex);
+
+    /* Its slot stays counted: an idle worker became an unspawned one */
+    Close(w->fd);
+    Free(w);
+}
+
+/*
+ * spawn_worker - start p's program as a pool worker and wait for its
+ * magic. Returns the worker, or NULL; *plain is set if the program ran
+ * but did not speak the protocol.
+ */
+static cgi_worker *spawn_worker(cgi_prog *p, bool *plain) {
+    static char *pool_env[] = { "TINY_CGI_POOL=1", NULL };
+    int sv[2];
+    char magic[sizeof(CGIPOOL_MAGIC) - 1];
+
+    *plain = false;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        return NULL;
+    }
+
+    cgi_worker *w = Calloc(1, sizeof(cgi_worker));
+    w->fd = sv[0];
+    w->prog = p;
+    P(&mutex);  // registered before the reaper can see it exit
+    if ((w->pid = spawn_cgi(p->path, sv[1], -1, pool_env)) < 0) {
+        V(&mutex);
+        Close(sv[0]);
+        Close(sv[1]);
+        Free(w);
+        return NULL;
+    }
+    w->wnext = workers;
+    if (workers) {
+        workers->wprev = w;
+    }
+    workers = w;
+    V(&mutex);
+    Close(sv[1]);
+
+    set_sock_timeouts(w->fd, HANDSHAKE_TIMEOUT_MS, CGIPOOL_TIMEOUT_MS);
+    if (rio_readn(w->fd, magic, sizeof(magic)) != sizeof(magic)
+            || memcmp(magic, CGIPOOL_MAGIC, sizeof(magic)) != 0) {
+        *plain = true;
+        kill_worker(w);
+        return NULL;
+    }
+    set_sock_timeouts(w->fd, CGIPOOL_TIMEOUT_MS, CGIPOOL_TIMEOUT_MS);
+    return w;
+}
+
+/*
+ * roundtrip - send one QUERY_STRING frame and read the response frame
+ * into a Malloc'ed buffer. Returns its length, or -1 on any failure.
+ */
+static ssize_t roundtrip(cgi_worker *w, const char *cgiargs,
+                         char **response) {
+    size_t arglen = strlen(cgiargs);
+    uint32_t len = htonl(arglen);
+    rio_wbuf_t wb;
+
+    rio_wbufinit(&wb, w->fd);
+    rio_wbufref(&wb, &len, sizeof(len));
+    rio_wbufref(&wb, cgiargs, arglen);
+    if (rio_wbufflush(&wb, 0) < 0) {
+        return -1;
+    }
+
+    if (rio_readn(w->fd, &len, sizeof(len)) != sizeof(len)) {
+        return -1;
+    }
+    len = ntohl(len);
+    if (len > CGIPOOL_MAX_RESPONSE) {
+        return -1;
+    }
+    char *buf = Malloc(len + 1);
+    if (rio_readn(w->fd, buf, len) != (ssize_t) len) {
+        Free(buf);
+        return -1;
+    }
+    *response = buf;
+    return len;
+}
+
+/*
+ * cgipool_run - run the CGI program filename with cgiargs on a pooled
+ * worker. Returns the length of its output, stored in *response (free
+ * with Free), or -1 if the program is not pooled or the worker failed;
+ * the caller then runs the program itself.
+ */
+ssize_t cgipool_run(const char *filename, const char *cgiargs,
+                    char **response) {
+    size_t len = strlen(filename), slen = strlen(CGIPOOL_SUFFIX);
+    cgi_prog *p;
+    cgi_worker *w;
+    bool plain;
+
+    if (max_workers == 0 || len < slen
+            || strcmp(filename + len - slen, CGIPOOL_SUFFIX) != 0) {
+        return -1;
+    }
+    P(&mutex);
+    p = find_prog(filename);
+    plain = p->kind == PROG_PLAIN;
+    V(&mutex);
+    if (plain) {
+        return -1;
+    }
+
+    P(&p->slots);
+    P(&mutex);
+    if (p->kind == PROG_PLAIN) {    // found out while we waited
+        V(&mutex);
+        V(&p->slots);
+        return -1;
+    }
+    if ((w = p->idle) != NULL) {
+        p->idle = w->next;
+        w->idle = false;
+    }
+    V(&mutex);
+
+    if (w == NULL && (w = spawn_worker(p, &plain)) == NULL) {
+        if (plain) {
+            P(&mutex);
+            p->kind = PROG_PLAIN;
+            V(&mutex);
+        }
+        V(&p->slots);
+        return -1;
+    }
+
+    ssize_t n = roundtrip(w, cgiargs, response);
+    if (n < 0) {
+        kill_worker(w);
+    } else {
+        P(&mutex);
+        p->kind = PROG_POOLED;
+        w->idle = true;
+        w->next = p->idle;
+        p->idle = w;
+        V(&mutex);
+    }
+    V(&p->slots);
+    return n;
+}
@@ -0,0 +1,31 @@
+/*
+ * cgipool.h - pools of pre-spawned, long-lived CGI workers for tiny.
+ *
+ * A CGI program opts in by a name ending in CGIPOOL_SUFFIX, say
+ * cgi-bin/adder.pool, and by speaking a small framed protocol; no other
+ * program is ever started without a request. It is started with
+ * TINY_CGI_POOL=1 in its environment and a Unix-domain stream socket
+ * as descriptor 0 (stdout goes to /dev/null). It first writes the 8 bytes
+ * CGIPOOL_MAGIC, then loops: read a frame holding QUERY_STRING, write a
+ * frame holding exactly what it would have printed to stdout as a plain
+ * CGI program. A frame is a 4-byte length in network byte order followed
+ * by that many bytes. A pool program that never sends the magic is served
+ * with one spawn per request, as every other program is.
+ */
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+
+#define CGIPOOL_MAGIC "TINYCGI1"
+#define CGIPOOL_SUFFIX ".pool"              /* marks a program as pooled */
+#define CGIPOOL_WORKERS 4                   /* default per program, -g */
+#define CGIPOOL_MAX_RESPONSE (1024 * 1024)
+#define CGIPOOL_TIMEOUT_MS 30000            /* per request round trip */
+
+void cgipool_init(int workers);
+ssize_t cgipool_run(const char *filename, const char *cgiargs,
+                    char **response);
+void cgipool_reaped(pid_t pid);
+
+#endif /* __CGIPOOL_H__ */
@@ -0,0 +1,17 @@
+/*
+ * cgispawn.h - launching CGI programs with posix_spawn, and reaping them
+ *     asynchronously from a thread that waits on a signalfd
+ */
+#ifndef __CGISPAWN_H__
+#define __CGISPAWN_H__
+
+#include "csapp.h"
+
+/* Called for every child that exits, before its pid is released */
+typedef void (*reaper_hook)(pid_t pid);
+
+void reaper_start(reaper_hook hook);
+pid_t spawn_cgi(const char *filename, int in_fd, int out_fd,
+                char *const extra_env[]);
+
+#endif /* __CGISPAWN_H__ */
@@ -617,6 +617,16 @@ int Accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
     return rc;
 }
 
+int Accept_cloexec(int s, struct sockaddr *addr, socklen_t *addrlen) {
+    int rc;
+
+    if ((rc = accept_cloexec(s, addr, addrlen)) < 0) {
+        unix_error("Accept_cloexec error");
+    }
+
+    return rc;
+}
+
 void Connect(int sockfd, struct sockaddr *serv_addr, int addrlen) {
     int rc;
 
@@ -829,17 +839,11 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
 
 
 /*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - Refill the internal buffer of rp with a call to read() if
+ *    it is empty. Returns the number of unread bytes in the buffer, 0 on
+ *    EOF and -1 on error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-    int cnt;
-
+static ssize_t rio_fill(rio_t *rp) {
     while (rp->rio_cnt <= 0) {      /* Refill if buf is empty */
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
         if (rp->rio_cnt < 0) {
@@ -854,6 +858,25 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
             rp->rio_bufptr = rp->rio_buf;   /* Reset buffer ptr */
         }
     }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+    ssize_t rc;
+    int cnt;
+
+    if ((rc = rio_fill(rp)) <= 0) {
+        return rc;                  /* EOF or error */
+    }
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -901,35 +924,277 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The newline is
+ *    located with memchr() over the internal buffer and the whole line
+ *    is copied at once instead of one rio_read() per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-    size_t n;
-    int rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *nl, *bufp = usrbuf;
+
+    if (maxlen == 0) {
+        return 0;
+    }
+    while (n < maxlen - 1) {
+        if ((rc = rio_fill(rp)) < 0) {
+            return -1;    /* Error */
+        } else if (rc == 0) {
+            break;        /* EOF, n bytes were read */
+        }
+
+        cnt = maxlen - 1 - n;
+        if ((size_t) rp->rio_cnt < cnt) {
+            cnt = rp->rio_cnt;
+        }
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL) {
+            cnt = nl - rp->rio_bufptr + 1;
+        }
+        memcpy(bufp, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        bufp += cnt;
+        n += cnt;
+        if (nl != NULL) {
+            break;
+        }
+    }
+    *bufp = 0;
+    return n;
+}
+/* $end rio_readlineb */
+
+/*
+ * rio_getlineb - Zero-copy variant of rio_readlineb. Points *linep at the
+ *    next line inside the internal buffer and returns its length,
+ *    including the newline. Unread bytes are shifted to the front of the
+ *    buffer when a line straddles its end; a line longer than RIO_BUFSIZE
+ *    is returned in RIO_BUFSIZE pieces. The line stays valid until the
+ *    next read from rp. Returns 0 on EOF and -1 on error.
+ */
+ssize_t rio_getlineb(rio_t *rp, char **linep) {
+    size_t scanned = 0, cnt;
+    ssize_t rc;
+    char *nl;
+
+    if (rp->rio_cnt <= 0) {
+        rp->rio_cnt = 0;
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while (1) {
+        nl = memchr(rp->rio_bufptr + scanned, '\n', rp->rio_cnt - scanned);
+        if (nl != NULL) {
+            cnt = nl - rp->rio_bufptr + 1;
+            break;
+        }
+        scanned = rp->rio_cnt;
+        if (rp->rio_cnt == RIO_BUFSIZE) {
+            cnt = RIO_BUFSIZE;  /* Line longer than the buffer */
+            break;
+        }
+
+        /* Make room behind the partial line and read some more */
+        if (rp->rio_bufptr != rp->rio_buf) {
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                RIO_BUFSIZE - rp->rio_cnt);
+        if (rc < 0) {
+            if (errno != EINTR) {
+                return -1;      /* errno set by read() */
             }
         } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break;    /* EOF, some data was read */
+            cnt = rp->rio_cnt;  /* EOF, return what is left */
+            if (cnt == 0) {
+                return 0;
             }
+            break;
         } else {
-            return -1;    /* Error */
+            rp->rio_cnt += rc;
         }
     }
-    *bufp = 0;
-    return n-1;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+/*
+ * rio_wbufinit - Associate a descriptor with an empty output buffer
+ */
+void rio_wbufinit(rio_wbuf_t *wp, int fd) {
+    wp->rio_fd = fd;
+    wp->rio_iovcnt = 0;
+    wp->rio_len = 0;
+    wp->rio_used = 0;
+}
+
+/*
+ * rio_wbufadvance - Drop the first n queued bytes, e.g. after part of the
+ *    buffer was written by someone else
+ */
+void rio_wbufadvance(rio_wbuf_t *wp, size_t n) {
+    struct iovec *iov = wp->rio_iov;
+    int i = 0;
+
+    while (i < wp->rio_iovcnt && n >= iov[i].iov_len) {
+        n -= iov[i].iov_len;
+        wp->rio_len -= iov[i].iov_len;
+        i++;
+    }
+    if (i < wp->rio_iovcnt && n > 0) {
+        iov[i].iov_base = (char *) iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+        wp->rio_len -= n;
+    }
+    wp->rio_iovcnt -= i;
+    memmove(iov, iov + i, wp->rio_iovcnt * sizeof(struct iovec));
+    if (wp->rio_iovcnt == 0) {
+        wp->rio_used = 0;
+    }
+}
+
+/*
+ * rio_wbufflush - Write every queued piece with as few sendmsg() calls as
+ *    possible (writev() when fd is not a socket). If more is nonzero the
+ *    kernel is told with MSG_MORE that further data follows, so headers
+ *    flushed early are not sent as a segment of their own. Returns the
+ *    number of bytes written, or -1 with errno set.
+ */
+ssize_t rio_wbufflush(rio_wbuf_t *wp, int more) {
+    size_t total = wp->rio_len;
+    ssize_t nwritten;
+    struct msghdr msg;
+
+    while (wp->rio_iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = wp->rio_iov;
+        msg.msg_iovlen = wp->rio_iovcnt;
+        nwritten = sendmsg(wp->rio_fd, &msg, more ? MSG_MORE : 0);
+        if (nwritten < 0 && errno == ENOTSOCK) {
+            nwritten = writev(wp->rio_fd, wp->rio_iov, wp->rio_iovcnt);
+        }
+        if (nwritten < 0) {
+            if (errno != EINTR) {
+                return -1;      /* errno set by sendmsg() */
+            }
+            continue;           /* Interrupted, call sendmsg() again */
+        }
+        rio_wbufadvance(wp, nwritten);
+    }
+    return total;
+}
+
+/*
+ * rio_wbufref - Queue n bytes of usrbuf without copying them. usrbuf must
+ *    stay valid until the buffer is flushed.
+ */
+ssize_t rio_wbufref(rio_wbuf_t *wp, const void *usrbuf, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    if (wp->rio_iovcnt == RIO_IOVMAX && rio_wbufflush(wp, 1) < 0) {
+        return -1;
+    }
+    wp->rio_iov[wp->rio_iovcnt].iov_base = (void *) usrbuf;
+    wp->rio_iov[wp->rio_iovcnt].iov_len = n;
+    wp->rio_iovcnt++;
+    wp->rio_len += n;
+    return n;
+}
+
+/*
+ * rio_wbufcopy - Queue a copy of n bytes of usrbuf. Use this for data that
+ *    will not outlive the call, such as a line inside a rio_t buffer.
+ *    Consecutive copies are merged into a single piece.
+ */
+ssize_t rio_wbufcopy(rio_wbuf_t *wp, const void *usrbuf, size_t n) {
+    struct iovec *last;
+    char *dst;
+
+    /* Flush first when no piece is left: flushing after the copy would
+       reset rio_used while the copy is still queued */
+    if (wp->rio_iovcnt == RIO_IOVMAX && rio_wbufflush(wp, 1) < 0) {
+        return -1;
+    }
+    if (n > RIO_BUFSIZE - wp->rio_used) {
+        if (rio_wbufflush(wp, 1) < 0) {
+            return -1;
+        }
+        if (n > RIO_BUFSIZE) {  /* Too big to copy, write it out now */
+            if (rio_wbufref(wp, usrbuf, n) < 0 || rio_wbufflush(wp, 1) < 0) {
+                return -1;
+            }
+            return n;
+        }
+    }
+
+    dst = wp->rio_buf + wp->rio_used;
+    memcpy(dst, usrbuf, n);
+    wp->rio_used += n;
+
+    last = wp->rio_iovcnt > 0 ? &wp->rio_iov[wp->rio_iovcnt - 1] : NULL;
+    if (last != NULL && (char *) last->iov_base + last->iov_len == dst) {
+        last->iov_len += n;
+        wp->rio_len += n;
+        return n;
+    }
+    return rio_wbufref(wp, dst, n);
+}
+
+/*
+ * rio_wbufprintf - Queue formatted text, e.g. a response header
+ */
+ssize_t rio_wbufprintf(rio_wbuf_t *wp, const char *fmt, ...) {
+    char line[MAXLINE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int) sizeof(line)) {
+        errno = EMSGSIZE;
+        return -1;  /* Overflow! */
+    }
+    return rio_wbufcopy(wp, line, n);
+}
+
+/*
+ * rio_cork - Set (on != 0) or clear TCP_CORK on a socket. While corked the
+ *    kernel only sends full segments; clearing it pushes out the rest.
+ */
+int rio_cork(int fd, int on) {
+    return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/*
+ * rio_sendfile - Robustly send n bytes of srcfd, starting at offset, to fd
+ *    with sendfile(2), so the data goes from the page cache to the socket
+ *    without passing through user space. Returns n, or -1 on error
+ *    (including srcfd ending early, with errno EIO).
+ */
+ssize_t rio_sendfile(int fd, int srcfd, off_t offset, size_t n) {
+    size_t nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+        if ((nsent = sendfile(fd, srcfd, &offset, nleft)) <= 0) {
+            if (nsent == 0) {
+                errno = EIO;    /* File shrank under us */
+                return -1;
+            }
+            if (errno != EINTR) {
+                return -1;      /* errno set by sendfile() */
+            }
+            nsent = 0;
+        }
+        nleft -= nsent;
+    }
+    return n;
 }
-/* $end rio_readlineb */
 
 /**********************************
  * Wrappers for robust I/O routines
@@ -971,9 +1236,59 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     return rc;
 }
 
+ssize_t Rio_getlineb(rio_t *rp, char **linep) {
+    ssize_t rc;
+
+    if ((rc = rio_getlineb(rp, linep)) < 0) {
+        unix_error("Rio_getlineb error");
+    }
+    return rc;
+}
+
 /********************************
  * Client/server helper functions
  ********************************/
+/*
+ * connect_timeout - connect() that gives up after timeout_ms milliseconds
+ *     with errno set to ETIMEDOUT. The descriptor is left blocking.
+ */
+static int connect_timeout(int fd, const struct sockaddr *addr,
+        socklen_t addrlen, int timeout_ms) {
+    int flags, rc, err;
+    socklen_t errlen = sizeof(err);
+    struct pollfd pfd;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0
+            || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+    rc = connect(fd, addr, addrlen);
+    if (rc < 0 && errno == EINPROGRESS) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        do {
+            rc = poll(&pfd, 1, timeout_ms);
+        } while (rc < 0 && errno == EINTR);
+
+        if (rc == 0) {
+            errno = ETIMEDOUT;
+            rc = -1;
+        } else if (rc > 0) {
+            rc = 0;
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+                rc = -1;
+            } else if (err != 0) {
+                errno = err;
+                rc = -1;
+            }
+        }
+    }
+    err = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = err;
+    return rc;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
@@ -984,7 +1299,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_clientfd */
-int open_clientfd(char *hostname, char *port) {
+static int clientfd_open(char *hostname, char *port, int timeout_ms) {
     int clientfd, rc;
     struct addrinfo hints, *listp, *p;
 
@@ -1008,7 +1323,13 @@ int open_clientfd(char *hostname, char *port) {
         }
 
         /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) {
+        if (timeout_ms > 0) {
+            rc = connect_timeout(clientfd, p->ai_addr, p->ai_addrlen,
+                    timeout_ms);
+        } else {
+            rc = connect(clientfd, p->ai_addr, p->ai_addrlen);
+        }
+        if (rc != -1) {
             break; /* Success */
         }
 
@@ -1028,8 +1349,45 @@ int open_clientfd(char *hostname, char *port) {
         return clientfd;
     }
 }
+
+int open_clientfd(char *hostname, char *port) {
+    return clientfd_open(hostname, port, 0);
+}
 /* $end open_clientfd */
 
+/*
+ * open_clientfd_timeout - Like open_clientfd, but every connect attempt
+ *     gives up after timeout_ms milliseconds (errno ETIMEDOUT).
+ */
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms) {
+    return clientfd_open(hostname, port, timeout_ms);
+}
+
+/*
+ * set_sock_timeouts - Bound how long a blocking read or write on fd may
+ *     wait. A call that runs out of time fails with EAGAIN. Zero leaves
+ *     that direction unbounded.
+ */
+int set_sock_timeouts(int fd, int read_ms, int write_ms) {
+    struct timeval tv;
+
+    if (read_ms > 0) {
+        tv.tv_sec = read_ms / 1000;
+        tv.tv_usec = (read_ms % 1000) * 1000;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+            return -1;
+        }
+    }
+    if (write_ms > 0) {
+        tv.tv_sec = write_ms / 1000;
+        tv.tv_usec = (write_ms % 1000) * 1000;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /*
  * open_listenfd - Open and return a listening socket on port. This
  *     function is reentrant and protocol-independent.
@@ -1039,7 +1397,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) {
+static int listenfd_open(char *port, int reuseport) {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
 
@@ -1066,6 +1424,14 @@ int open_listenfd(char *port) {
         setsockopt(listenfd, SOL_SOCKET,    //line:netp:csapp:setsockopt
                 SO_REUSEADDR, (const void *) &optval , sizeof(int));
 
+        /* Let other sockets bind the same port, the kernel spreads
+           incoming connections across them */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                    (const void *) &optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
             break; /* Success */
@@ -1091,8 +1457,61 @@ int open_listenfd(char *port) {
     }
     return listenfd;
 }
+
+int open_listenfd(char *port) {
+    return listenfd_open(port, 0);
+}
 /* $end open_listenfd */
 
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but with SO_REUSEPORT set
+ *     so that several sockets, one per worker, can listen on the same
+ *     port and the kernel load-balances new connections between them.
+ */
+int open_reuseport_listenfd(char *port) {
+    return listenfd_open(port, 1);
+}
+
+/*
+ * pin_cpu - Restrict the calling thread to one CPU. New threads inherit
+ *     the mask, so connections served by an acceptor's threads stay on
+ *     the acceptor's core. Returns -1 with errno set on failure.
+ */
+int pin_cpu(int cpu) {
+#ifdef __linux__
+    unsigned long mask[16];
+
+    if (cpu < 0 || (size_t) cpu >= sizeof(mask) * 8) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / (8 * sizeof(long))] |= 1UL << (cpu % (8 * sizeof(long)));
+    return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0 ? -1 : 0;
+#else
+    (void) cpu;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * accept_cloexec - Like accept, but the new descriptor is close-on-exec
+ *     from the start, so a program spawned by another thread at the same
+ *     moment cannot inherit it. Returns -1 with errno set on failure.
+ */
+int accept_cloexec(int listenfd, struct sockaddr *addr, socklen_t *addrlen) {
+#ifdef SYS_accept4
+    return syscall(SYS_accept4, listenfd, addr, addrlen, SOCK_CLOEXEC);
+#else
+    int connfd = accept(listenfd, addr, addrlen);
+    if (connfd >= 0) {
+        fcntl(connfd, F_SETFD, FD_CLOEXEC);
+    }
+    return connfd;
+#endif
+}
+
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
  ****************************************************/
@@ -1114,5 +1533,14 @@ int Open_listenfd(char *port) {
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port) {
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0) {
+        unix_error("Open_reuseport_listenfd error");
+    }
+    return rc;
+}
+
 /* $end csapp.c */
 
@@ -0,0 +1,213 @@
+/*
+ * fdcache.c - bounded LRU table of open files, keyed by path.
+ *
+ * An entry is trusted for FDCACHE_REVALIDATE seconds. After that the next
+ * lookup stats the path, and if it now names another file, or the file
+ * was modified, the entry is dropped and the path opened again. An
+ * entry's stat therefore never changes once it is published. Users read
+ * through the shared descriptor with pread() or sendfile() at an explicit
+ * offset, never moving its file position.
+ */
+#include "fdcache.h"
+#include <stdbool.h>
+
+#define FD_BUCKETS 256
+
+static fd_entry *buckets[FD_BUCKETS];
+static fd_entry *lru_head, *lru_tail;
+static int entries;
+static sem_t mutex;             // protects everything above
+
+void fdcache_init(void) {
+    Sem_init(&mutex, 0, 1);
+}
+
+static unsigned fd_hash(const char *path) {
+    unsigned h = 5381;
+    for (; *path; path++) {
+        h = h * 33 + (unsigned char) *path;
+    }
+    return h;
+}
+
+static void entry_free(fd_entry *e) {
+    Close(e->fd);
+    Free(e->path);
+    Free(e);
+}
+
+static void lru_unlink(fd_entry *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+}
+
+static void lru_push(fd_entry *e) {
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = e;
+    } else {
+        lru_tail = e;
+    }
+    lru_head = e;
+}
+
+/*
+ * unlink_entry - take e out of the table and drop the cache's reference.
+ * mutex held; returns e if it must be freed now.
+ */
+static fd_entry *unlink_entry(fd_entry *e) {
+    fd_entry **pp = &buckets[e->hash % FD_BUCKETS];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    lru_unlink(e);
+    entries--;
+    return --e->refcnt == 0 ? e : NULL;
+}
+
+static fd_entry *lookup(const char *path, unsigned hash) {
+    fd_entry *e;
+    for (e = buckets[hash % FD_BUCKETS]; e != NULL; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * revalidate - stat e's path again. Returns true if it is still the same,
+ * unmodified file; false if the entry must be dropped.
+ */
+static bool revalidate(fd_entry *e, time_t now) {
+    struct stat st;
+
+    if (stat(e->path, &st) < 0
+            || st.st_dev != e->st.st_dev || st.st_ino != e->st.st_ino
+            || st.st_size != e->st.st_size || st.st_mode != e->st.st_mode
+            || st.st_mtim.tv_sec != e->st.st_mtim.tv_sec
+            || st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec) {
+        return false;
+    }
+    P(&mutex);
+    e->checked = now;
+    V(&mutex);
+    return true;
+}
+
+/*
+ * insert - open path and add it to the table. Returns the pinned entry,
+ * or NULL with errno set by open()/fstat(), or to EACCES if path is not
+ * a regular file. The open does not block, so a FIFO cannot hang the
+ * worker.
+ */
+static fd_entry *insert(const char *path, unsigned hash, time_t now) {
+    fd_entry *e = Calloc(1, sizeof(fd_entry));
+
+    if ((e->fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK, 0)) < 0) {
+        Free(e);
+        return NULL;
+    }
+    int err = fstat(e->fd, &e->st) < 0 ? errno
+        : !S_ISREG(e->st.st_mode) ? EACCES : 0;
+    if (err != 0) {
+        Close(e->fd);
+        Free(e);
+        errno = err;
+        return NULL;
+    }
+    e->path = Malloc(strlen(path) + 1);
+    strcpy(e->path, path);
+    e->hash = hash;
+    e->checked = now;
+    e->refcnt = 2;              // the cache and the caller
+
+    fd_entry *victims = NULL, *old;
+    P(&mutex);
+    if ((old = lookup(path, hash)) != NULL && unlink_entry(old)) {
+        old->hnext = victims;
+        victims = old;
+    }
+    while (entries >= FDCACHE_ENTRIES) {
+        old = lru_tail;
+        if (unlink_entry(old)) {
+            old->hnext = victims;
+            victims = old;
+        }
+    }
+    e->hnext = buckets[hash % FD_BUCKETS];
+    buckets[hash % FD_BUCKETS] = e;
+    lru_push(e);
+    entries++;
+    V(&mutex);
+
+    /* Close outside the lock */
+    while (victims) {
+        old = victims;
+        victims = old->hnext;
+        entry_free(old);
+    }
+    return e;
+}
+
+/*
+ * fdcache_open - return a pinned entry holding an open descriptor for path
+ * and its current stat, opening the file if it is not cached. Returns
+ * NULL with errno set if the file cannot be opened or is not a regular
+ * file. Release with fdcache_put.
+ */
+fd_entry *fdcache_open(const char *path) {
+    unsigned hash = fd_hash(path);
+    time_t now = time(NULL);
+    fd_entry *e;
+
+    P(&mutex);
+    if ((e = lookup(path, hash)) == NULL) {
+        V(&mutex);
+        return insert(path, hash, now);
+    }
+    e->refcnt++;
+    lru_unlink(e);
+    lru_push(e);
+    bool fresh = now - e->checked < FDCACHE_REVALIDATE;
+    V(&mutex);
+
+    if (fresh || revalidate(e, now)) {
+        return e;
+    }
+
+    /* The file changed, was replaced or is gone */
+    fd_entry *victim = NULL;
+    P(&mutex);
+    if (lookup(path, hash) == e) {
+        victim = unlink_entry(e);
+    }
+    V(&mutex);
+    if (victim) {
+        entry_free(victim);
+    }
+    fdcache_put(e);
+    return insert(path, hash, now);
+}
+
+/*
+ * fdcache_put - drop a reference taken by fdcache_open
+ */
+void fdcache_put(fd_entry *e) {
+    P(&mutex);
+    int left = --e->refcnt;
+    V(&mutex);
+    if (left == 0) {
+        entry_free(e);
+    }
+}
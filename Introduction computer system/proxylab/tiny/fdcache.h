@@ -0,0 +1,32 @@
+/*
+ * fdcache.h - cache of open descriptors and their stat results for tiny,
+ *     so repeated requests for a file skip the path walk in the kernel
+ */
+#ifndef __FDCACHE_H__
+#define __FDCACHE_H__
+
+#include "csapp.h"
+
+/* Descriptors kept open at most */
+#define FDCACHE_ENTRIES 256
+
+/* Seconds an entry is trusted before its path is stat'ed again */
+#define FDCACHE_REVALIDATE 1
+
+typedef struct fd_entry {
+    char *path;
+    int fd;                     // open O_RDONLY, closed with the entry
+    struct stat st;             // taken when the file was opened
+    time_t checked;
+    unsigned hash;
+    int refcnt;                 // one for the cache, one per user
+    struct fd_entry *hnext;     // hash chain
+    struct fd_entry *next;      // LRU list, most recent first
+    struct fd_entry *prev;
+} fd_entry;
+
+void fdcache_init(void);
+fd_entry *fdcache_open(const char *path);
+void fdcache_put(fd_entry *e);
+
+#endif /* __FDCACHE_H__ */
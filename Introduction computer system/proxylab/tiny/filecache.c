@@ -0,0 +1,315 @@
+/*
+ * filecache.c - bounded LRU cache of static files, keyed by path and
+ * content coding.
+ *
+ * An entry remembers the device, inode, size, mode and mtime of the file it
+ * was read from. For FILECACHE_REVALIDATE seconds after the last check a
+ * hit costs no filesystem call at all; after that the next hit stats the
+ * path once and drops the entry if the file was replaced or changed. An
+ * encoded entry is validated against the file it encodes and, when its
+ * body was read from a precompressed sibling, against that sibling too.
+ * Entries are reference counted so an evicted one stays valid until the
+ * last reader is done writing it out.
+ */
+#include "filecache.h"
+
+#define FC_BUCKETS 256
+
+static fc_entry *buckets[FC_BUCKETS];
+static fc_entry *lru_head, *lru_tail;
+static size_t cache_bytes;          // sum of entry sizes in the cache
+static size_t cache_limit;          // 0: cache disabled
+static sem_t mutex;                 // protects everything above
+
+void filecache_init(size_t max_bytes) {
+    Sem_init(&mutex, 0, 1);
+    cache_limit = max_bytes;
+}
+
+static unsigned fc_hash(const char *path, unsigned encoding) {
+    unsigned h = 5381;
+    for (; *path; path++) {
+        h = h * 33 + (unsigned char) *path;
+    }
+    return h * 33 + encoding;
+}
+
+static void entry_free(fc_entry *e) {
+    Free(e->data);
+    Free(e->path);
+    Free(e->src);
+    Free(e);
+}
+
+/*
+ * unlink_entry - take e out of the table and the LRU list and drop the
+ * cache's reference. mutex held; returns e if it must be freed now.
+ */
+static fc_entry *unlink_entry(fc_entry *e) {
+    fc_entry **pp = &buckets[e->hash % FC_BUCKETS];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+    cache_bytes -= e->size;
+    return --e->refcnt == 0 ? e : NULL;
+}
+
+static void lru_push(fc_entry *e) {
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = e;
+    } else {
+        lru_tail = e;
+    }
+    lru_head = e;
+}
+
+static fc_entry *lookup(const char *path, unsigned encoding,
+                        unsigned hash) {
+    fc_entry *e;
+    for (e = buckets[hash % FC_BUCKETS]; e != NULL; e = e->hnext) {
+        if (e->hash == hash && e->encoding == encoding
+                && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static bool same_file(const fc_entry *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino
+        && e->filesize == st->st_size && e->mode == st->st_mode
+        && e->mtime.tv_sec == st->st_mtim.tv_sec
+        && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static bool same_src(const fc_entry *e, const struct stat *st) {
+    return e->src_dev == st->st_dev && e->src_ino == st->st_ino
+        && e->src_size == st->st_size
+        && e->src_mtime.tv_sec == st->st_mtim.tv_sec
+        && e->src_mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * filecache_get - return the pinned entry for path in the given coding,
+ * or NULL on a miss or when the file changed since it was cached. Release
+ * with filecache_put.
+ */
+fc_entry *filecache_get(const char *path, unsigned encoding) {
+    unsigned hash = fc_hash(path, encoding);
+    time_t now = time(NULL);
+    fc_entry *e;
+
+    if (cache_limit == 0) {
+        return NULL;
+    }
+
+    P(&mutex);
+    if ((e = lookup(path, encoding, hash)) == NULL) {
+        V(&mutex);
+        return NULL;
+    }
+    e->refcnt++;
+    if (e->prev) {      // move to the front of the LRU list
+        e->prev->next = e->next;
+        if (e->next) {
+            e->next->prev = e->prev;
+        } else {
+            lru_tail = e->prev;
+        }
+        lru_push(e);
+    }
+    bool fresh = now - e->checked < FILECACHE_REVALIDATE;
+    V(&mutex);
+
+    if (fresh) {
+        return e;
+    }
+
+    /* Revalidate outside the lock, stat may block on the disk */
+    struct stat st;
+    bool valid = stat(path, &st) == 0 && same_file(e, &st)
+        && (e->src == NULL || (stat(e->src, &st) == 0 && same_src(e, &st)));
+
+    fc_entry *victim = NULL;
+    P(&mutex);
+    if (valid) {
+        e->checked = now;
+    } else if (lookup(path, encoding, hash) == e) {
+        victim = unlink_entry(e);
+    }
+    V(&mutex);
+    if (victim) {
+        entry_free(victim);
+    }
+    if (!valid) {
+        filecache_put(e);
+        return NULL;
+    }
+    return e;
+}
+
+/*
+ * filecache_fits - whether a body of len bytes, plus headers, could be
+ * cached at all
+ */
+bool filecache_fits(size_t len) {
+    size_t max_object = cache_limit < FILECACHE_MAX_OBJECT
+        ? cache_limit : FILECACHE_MAX_OBJECT;
+    return len + MAXBUF <= max_object;
+}
+
+/*
+ * entry_new - allocate an entry for path and its headers, with room for a
+ * body of len bytes. Returns NULL if it would be too big to cache.
+ */
+static fc_entry *entry_new(const char *path, unsigned encoding,
+                           const struct stat *st,
+                           const char *hdr, size_t hdr_len, size_t len) {
+    size_t max_object = cache_limit < FILECACHE_MAX_OBJECT
+        ? cache_limit : FILECACHE_MAX_OBJECT;
+
+    if (cache_limit == 0 || len + hdr_len > max_object) {
+        return NULL;
+    }
+
+    fc_entry *e = Calloc(1, sizeof(fc_entry));
+    e->size = hdr_len + len;
+    e->data = Malloc(e->size);
+    memcpy(e->data, hdr, hdr_len);
+    e->path = Malloc(strlen(path) + 1);
+    strcpy(e->path, path);
+    e->encoding = encoding;
+    e->hdr_len = hdr_len;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->filesize = st->st_size;
+    e->mode = st->st_mode;
+    e->mtime = st->st_mtim;
+    e->checked = time(NULL);
+    e->hash = fc_hash(path, encoding);
+    e->refcnt = 2;              // the cache and the caller
+    return e;
+}
+
+/*
+ * publish - replace any older copy of e, then evict from the tail until
+ * it fits. Returns e.
+ */
+static fc_entry *publish(fc_entry *e) {
+    fc_entry *victims = NULL, *old;
+
+    P(&mutex);
+    if ((old = lookup(e->path, e->encoding, e->hash)) != NULL
+            && unlink_entry(old)) {
+        old->hnext = victims;
+        victims = old;
+    }
+    while (cache_bytes + e->size > cache_limit && lru_tail != NULL) {
+        old = lru_tail;
+        if (unlink_entry(old)) {
+            old->hnext = victims;
+            victims = old;
+        }
+    }
+    e->hnext = buckets[e->hash % FC_BUCKETS];
+    buckets[e->hash % FC_BUCKETS] = e;
+    lru_push(e);
+    cache_bytes += e->size;
+    V(&mutex);
+
+    /* Free outside the lock */
+    while (victims) {
+        old = victims;
+        victims = old->hnext;
+        entry_free(old);
+    }
+    return e;
+}
+
+/*
+ * filecache_load - cache, for path (stat'ed into st) in the given coding,
+ * the hdr_len bytes of response headers in hdr followed by len bytes read
+ * from srcfd. srcfd is path itself, with src NULL, or the precompressed
+ * sibling src holding the encoded body, which the entry then depends on
+ * as well. Returns the pinned entry, or NULL if it is too big to cache or
+ * cannot be read; the caller then serves it from disk.
+ */
+fc_entry *filecache_load(const char *path, unsigned encoding,
+                         const struct stat *st,
+                         const char *hdr, size_t hdr_len,
+                         const char *src, int srcfd, size_t len) {
+    fc_entry *e = entry_new(path, encoding, st, hdr, hdr_len, len);
+    struct stat sst;
+    if (e == NULL) {
+        return NULL;
+    }
+    if (src != NULL) {
+        if (fstat(srcfd, &sst) < 0) {
+            entry_free(e);
+            return NULL;
+        }
+        e->src = Malloc(strlen(src) + 1);
+        strcpy(e->src, src);
+        e->src_dev = sst.st_dev;
+        e->src_ino = sst.st_ino;
+        e->src_size = sst.st_size;
+        e->src_mtime = sst.st_mtim;
+    }
+
+    /* srcfd may be shared, so read at explicit offsets */
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(srcfd, e->data + hdr_len + done,
+                          len - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {           // error, or truncated while we read it
+            entry_free(e);
+            return NULL;
+        }
+        done += n;
+    }
+    return publish(e);
+}
+
+/*
+ * filecache_add - like filecache_load, with the body copied from memory
+ */
+fc_entry *filecache_add(const char *path, unsigned encoding,
+                        const struct stat *st,
+                        const char *hdr, size_t hdr_len,
+                        const char *body, size_t len) {
+    fc_entry *e = entry_new(path, encoding, st, hdr, hdr_len, len);
+    if (e == NULL) {
+        return NULL;
+    }
+    memcpy(e->data + hdr_len, body, len);
+    return publish(e);
+}
+
+/*
+ * filecache_put - drop a reference taken by filecache_get/filecache_load
+ */
+void filecache_put(fc_entry *e) {
+    P(&mutex);
+    int left = --e->refcnt;
+    V(&mutex);
+    if (left == 0) {
+        entry_free(e);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * filecache.h - in-memory cache of hot static files for tiny. Each entry
+ *     holds the prebuilt response headers followed by the body, the file
+ *     contents in one content coding, so a hit is served with one
+ *     gathered write.
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/* Defaults, changed with -c on the command line */
+#define FILECACHE_SIZE (16 * 1024 * 1024)
+#define FILECACHE_MAX_OBJECT (1024 * 1024)
+
+/* Seconds an entry is trusted before its file is stat'ed again */
+#define FILECACHE_REVALIDATE 1
+
+typedef struct fc_entry {
+    char *path;
+    unsigned encoding;          // HTTP_ENC_* the entry answers, 0: identity
+    char *data;                 // headers, then the body
+    size_t hdr_len;             // bytes of headers at the start of data
+    size_t size;                // hdr_len + body size
+    dev_t dev;                  // identity of path when the entry was made
+    ino_t ino;
+    off_t filesize;
+    mode_t mode;
+    struct timespec mtime;
+    char *src;                  // sibling the body was read from, or NULL
+    dev_t src_dev;              // its identity when the entry was made
+    ino_t src_ino;
+    off_t src_size;
+    struct timespec src_mtime;
+    time_t checked;             // last time the above matched the files
+    unsigned hash;
+    int refcnt;                 // one for the cache, one per reader
+    struct fc_entry *hnext;     // hash chain
+    struct fc_entry *next;      // LRU list, most recent first
+    struct fc_entry *prev;
+} fc_entry;
+
+void filecache_init(size_t max_bytes);
+fc_entry *filecache_get(const char *path, unsigned encoding);
+fc_entry *filecache_load(const char *path, unsigned encoding,
+                         const struct stat *st,
+                         const char *hdr, size_t hdr_len,
+                         const char *src, int srcfd, size_t len);
+fc_entry *filecache_add(const char *path, unsigned encoding,
+                        const struct stat *st,
+                        const char *hdr, size_t hdr_len,
+                        const char *body, size_t len);
+void filecache_put(fc_entry *e);
+bool filecache_fits(size_t len);
+
+#endif /* __FILECACHE_H__ */
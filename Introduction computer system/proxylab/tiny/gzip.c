@@ -0,0 +1,60 @@
+/*
+ * gzip.c - compress a file with zlib into a gzip member in memory.
+ *
+ * Output is only produced once per file version and then cached, so the
+ * highest compression level is worth its CPU time.
+ */
+#include "gzip.h"
+#include <zlib.h>
+
+/*
+ * gzip_file - compress the first len bytes of srcfd, read with pread so a
+ * shared descriptor is not disturbed. Returns a Malloc'ed buffer holding
+ * *outlen bytes, or NULL on error or if the file changed size meanwhile.
+ */
+char *gzip_file(int srcfd, size_t len, size_t *outlen) {
+    z_stream zs;
+    char in[MAXBUF];
+    size_t done = 0;
+    int rc = Z_OK;      // tested even when the first pread is retried
+
+    memset(&zs, 0, sizeof(zs));
+    /* 15 window bits, plus 16 for a gzip header and trailer */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    /* deflateBound is enough for the whole output in one pass */
+    size_t cap = deflateBound(&zs, len);
+    char *out = Malloc(cap);
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = cap;
+
+    do {
+        ssize_t n = 0;
+        if (done < len) {
+            size_t want = len - done < sizeof(in) ? len - done : sizeof(in);
+            if ((n = pread(srcfd, in, want, done)) < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {       // error, or truncated while we read it
+                deflateEnd(&zs);
+                Free(out);
+                return NULL;
+            }
+            done += n;
+        }
+        zs.next_in = (Bytef *) in;
+        zs.avail_in = n;
+        rc = deflate(&zs, done == len ? Z_FINISH : Z_NO_FLUSH);
+    } while (rc == Z_OK);
+
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        Free(out);
+        return NULL;
+    }
+    *outlen = zs.total_out;
+    return out;
+}
@@ -0,0 +1,12 @@
+/*
+ * gzip.h - one-shot gzip compression of a file for tiny's encoded cache
+ *     entries
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+
+char *gzip_file(int srcfd, size_t len, size_t *outlen);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,530 @@
+/*                                                                            *
+ *  http.c                                                                    *
+ *  this file tokenizes http header blocks for the web proxy  . :)            *
+ *  headers are scanned in one pass: ':' and '\n' are located with SSE2 (or   *
+ *  AVX2 when the compiler targets it) and known names are classified by      *
+ *  length plus a case-insensitive hash, nothing is copied                    *
+ *                                                                            *
+ */
+#include "http.h"
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* size of the open-addressed name table, must be a power of two */
+#define HDR_SLOTS 64
+
+typedef struct {
+    const char *name;
+    size_t len;
+    unsigned hash;
+    http_hdr_id id;
+} hdr_slot;
+
+static const struct {
+    const char *name;
+    http_hdr_id id;
+} known_headers[] = {
+    { "Host",              HDR_HOST },
+    { "User-Agent",        HDR_USER_AGENT },
+    { "Connection",        HDR_CONNECTION },
+    { "Proxy-Connection",  HDR_PROXY_CONNECTION },
+    { "Keep-Alive",        HDR_KEEP_ALIVE },
+    { "Content-Length",    HDR_CONTENT_LENGTH },
+    { "Content-Type",      HDR_CONTENT_TYPE },
+    { "Transfer-Encoding", HDR_TRANSFER_ENCODING },
+    { "Range",             HDR_RANGE },
+    { "If-Range",          HDR_IF_RANGE },
+    { "ETag",              HDR_ETAG },
+    { "Last-Modified",     HDR_LAST_MODIFIED },
+    { "If-None-Match",     HDR_IF_NONE_MATCH },
+    { "If-Modified-Since", HDR_IF_MODIFIED_SINCE },
+    { "Date",              HDR_DATE },
+    { "Expires",           HDR_EXPIRES },
+    { "Cache-Control",     HDR_CACHE_CONTROL },
+    { "Accept-Encoding",   HDR_ACCEPT_ENCODING },
+    { "Content-Encoding",  HDR_CONTENT_ENCODING },
+    { "Vary",              HDR_VARY },
+    { "X-Proxy-Peer",      HDR_PROXY_PEER },
+};
+
+static hdr_slot hdr_table[HDR_SLOTS];
+static pthread_once_t hdr_once = PTHREAD_ONCE_INIT;
+
+/*
+ * hdr_hash : FNV-1a over the lower-cased name
+ */
+static unsigned hdr_hash(const char *name, size_t len)
+{
+    unsigned h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i] | 0x20;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * hdr_table_init : fill the name table once, linear probing on collision
+ */
+static void hdr_table_init(void)
+{
+    size_t i;
+    for (i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]); i++) {
+        size_t len = strlen(known_headers[i].name);
+        unsigned h = hdr_hash(known_headers[i].name, len);
+        unsigned slot = h & (HDR_SLOTS - 1);
+        while (hdr_table[slot].name != NULL) {
+            slot = (slot + 1) & (HDR_SLOTS - 1);
+        }
+        hdr_table[slot].name = known_headers[i].name;
+        hdr_table[slot].len = len;
+        hdr_table[slot].hash = h;
+        hdr_table[slot].id = known_headers[i].id;
+    }
+}
+
+/*
+ * http_header_id : classify a header name, HDR_OTHER when unknown
+ */
+http_hdr_id http_header_id(const char *name, size_t len)
+{
+    Pthread_once(&hdr_once, hdr_table_init);
+
+    unsigned h = hdr_hash(name, len);
+    unsigned slot = h & (HDR_SLOTS - 1);
+    while (hdr_table[slot].name != NULL) {
+        if (hdr_table[slot].len == len && hdr_table[slot].hash == h
+                && strncasecmp(hdr_table[slot].name, name, len) == 0) {
+            return hdr_table[slot].id;
+        }
+        slot = (slot + 1) & (HDR_SLOTS - 1);
+    }
+    return HDR_OTHER;
+}
+
+/*
+ * http_scan2 : return the first byte in [p, end) equal to a or b,
+ * NULL when there is none. 32 or 16 bytes are compared per step.
+ */
+const char *http_scan2(const char *p, const char *end, char a, char b)
+{
+#if defined(__AVX2__)
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                _mm256_cmpeq_epi8(v, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i xa = _mm_set1_epi8(a);
+    const __m128i xb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(v, xa), _mm_cmpeq_epi8(v, xb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == a || *p == b) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * http_next_header : tokenize the header line starting at *pcur.
+ * On HTTP_HDR_FIELD, HTTP_HDR_END and HTTP_HDR_BAD *pcur is moved past the
+ * line; on HTTP_HDR_PARTIAL it is left alone so the caller can read more.
+ */
+http_hdr_result http_next_header(const char **pcur, const char *end,
+                                 http_header *hdr)
+{
+    const char *line = *pcur;
+    const char *colon = NULL;
+    const char *nl = http_scan2(line, end, ':', '\n');
+
+    if (nl != NULL && *nl == ':') {
+        colon = nl;
+        nl = memchr(colon + 1, '\n', end - colon - 1);
+    }
+    if (nl == NULL) {
+        return HTTP_HDR_PARTIAL;
+    }
+
+    *pcur = nl + 1;
+    hdr->id = HDR_OTHER;
+    hdr->line.ptr = line;
+    hdr->line.len = nl + 1 - line;
+
+    /* strip the CR of CRLF, then check for the empty line */
+    const char *eol = nl;
+    if (eol > line && eol[-1] == '\r') {
+        eol--;
+    }
+    if (eol == line) {
+        return HTTP_HDR_END;
+    }
+    if (colon == NULL) {
+        return HTTP_HDR_BAD;
+    }
+
+    hdr->name.ptr = line;
+    hdr->name.len = colon - line;
+    hdr->id = http_header_id(line, colon - line);
+
+    const char *vbegin = colon + 1;
+    while (vbegin < eol && (*vbegin == ' ' || *vbegin == '\t')) {
+        vbegin++;
+    }
+    while (eol > vbegin && (eol[-1] == ' ' || eol[-1] == '\t')) {
+        eol--;
+    }
+    hdr->value.ptr = vbegin;
+    hdr->value.len = eol - vbegin;
+    return HTTP_HDR_FIELD;
+}
+
+/*
+ * http_slice_eq : case-insensitive comparison of a slice with a C string
+ */
+bool http_slice_eq(http_slice s, const char *str)
+{
+    return strlen(str) == s.len && strncasecmp(s.ptr, str, s.len) == 0;
+}
+
+/*
+ * http_parse_size : parse a decimal slice such as a Content-Length value;
+ * a value that does not fit in a size_t is rejected
+ */
+bool http_parse_size(http_slice s, size_t *psize)
+{
+    size_t i, v = 0;
+    if (s.len == 0) {
+        return false;
+    }
+    for (i = 0; i < s.len; i++) {
+        if (s.ptr[i] < '0' || s.ptr[i] > '9') {
+            return false;
+        }
+        size_t digit = s.ptr[i] - '0';
+        if (v > (SIZE_MAX - digit) / 10) {
+            return false;   // would wrap around
+        }
+        v = v * 10 + digit;
+    }
+    *psize = v;
+    return true;
+}
+
+/*
+ * http_read_request : read the header block that follows a request line
+ * into req. Returns 0 on success, -1 when the client went away and -2
+ * when the block does not fit in req->buf or a line does not fit in the
+ * rio buffer; the rest of such a line must not be read as a new header.
+ */
+int http_read_request(rio_t *rp, http_request *req)
+{
+    char *line;
+    ssize_t n;
+    http_header hdr;
+
+    req->len = 0;
+    memset(req->field, 0, sizeof(req->field));
+    while ((n = rio_getlineb(rp, &line)) > 0) {
+        if (line[n - 1] != '\n') {
+            return -2;  // cut short by the buffer, or by EOF
+        }
+        const char *cur = line;
+        http_hdr_result rc = http_next_header(&cur, line + n, &hdr);
+        if (rc == HTTP_HDR_END) {
+            return 0;
+        }
+        if (rc != HTTP_HDR_FIELD) {
+            continue;   // drop malformed lines
+        }
+        if ((size_t) n > sizeof(req->buf) - req->len) {
+            return -2;
+        }
+
+        // keep the line and re-point the value into our copy
+        char *dst = req->buf + req->len;
+        memcpy(dst, line, n);
+        req->len += n;
+        if (hdr.id != HDR_OTHER) {
+            req->field[hdr.id].ptr = dst + (hdr.value.ptr - line);
+            req->field[hdr.id].len = hdr.value.len;
+        }
+    }
+    return -1;
+}
+
+/*
+ * http_parse_range : interpret a Range value against an object of size
+ * bytes. Only a single "bytes=" range is honoured; a list of ranges or a
+ * syntax error makes the whole object the answer, as RFC 7233 allows.
+ */
+http_range_result http_parse_range(http_slice s, size_t size,
+                                   size_t *pfirst, size_t *plast)
+{
+    static const char unit[] = "bytes=";
+    const size_t unitlen = sizeof(unit) - 1;
+    if (s.len <= unitlen || strncasecmp(s.ptr, unit, unitlen) != 0
+            || memchr(s.ptr, ',', s.len) != NULL) {
+        return HTTP_RANGE_NONE;
+    }
+
+    const char *spec = s.ptr + unitlen;
+    const char *end = s.ptr + s.len;
+    const char *dash = memchr(spec, '-', end - spec);
+    if (dash == NULL) {
+        return HTTP_RANGE_NONE;
+    }
+    http_slice a = { spec, dash - spec };
+    http_slice b = { dash + 1, end - dash - 1 };
+    size_t first, last;
+
+    if (a.len == 0) {
+        // "-n": the last n bytes
+        size_t n;
+        if (!http_parse_size(b, &n)) {
+            return HTTP_RANGE_NONE;
+        }
+        if (n == 0 || size == 0) {
+            return HTTP_RANGE_UNSATISFIABLE;
+        }
+        first = n < size ? size - n : 0;
+        last = size - 1;
+    } else {
+        if (!http_parse_size(a, &first)) {
+            return HTTP_RANGE_NONE;
+        }
+        if (b.len == 0) {
+            last = (size_t) -1;
+        } else if (!http_parse_size(b, &last) || last < first) {
+            return HTTP_RANGE_NONE;
+        }
+        if (first >= size) {
+            return HTTP_RANGE_UNSATISFIABLE;
+        }
+        if (last >= size) {
+            last = size - 1;
+        }
+    }
+    *pfirst = first;
+    *plast = last;
+    return HTTP_RANGE_OK;
+}
+
+/*
+ * http_if_range_match : does an If-Range value still describe the stored
+ * object? An entity tag must match strongly, a date must equal
+ * Last-Modified exactly.
+ */
+bool http_if_range_match(http_slice cond, http_slice etag,
+                         http_slice last_modified)
+{
+    if (cond.len > 0 && (cond.ptr[0] == '"' || cond.ptr[0] == 'W')) {
+        return cond.ptr[0] == '"' && etag.len > 0 && etag.ptr[0] == '"'
+            && cond.len == etag.len
+            && memcmp(cond.ptr, etag.ptr, etag.len) == 0;
+    }
+    return cond.len > 0 && cond.len == last_modified.len
+        && memcmp(cond.ptr, last_modified.ptr, cond.len) == 0;
+}
+
+/*
+ * http_parse_date : parse an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"),
+ * the only format a server may generate
+ */
+bool http_parse_date(http_slice s, time_t *pt)
+{
+    char date[64];
+    struct tm tm;
+    if (s.len == 0 || s.len >= sizeof(date)) {
+        return false;
+    }
+    memcpy(date, s.ptr, s.len);
+    date[s.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    char *rest = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (rest == NULL || *rest != '\0') {
+        return false;
+    }
+    *pt = timegm(&tm);
+    return true;
+}
+
+/*
+ * http_etag_list_match : does an If-None-Match list name etag? Uses the
+ * weak comparison, so W/"x" and "x" are the same tag.
+ */
+bool http_etag_list_match(http_slice list, http_slice etag)
+{
+    if (etag.len > 2 && etag.ptr[0] == 'W' && etag.ptr[1] == '/') {
+        etag.ptr += 2;
+        etag.len -= 2;
+    }
+    if (list.len == 1 && list.ptr[0] == '*') {
+        return true;
+    }
+    if (etag.len == 0) {
+        return false;
+    }
+
+    const char *cur = list.ptr;
+    const char *end = list.ptr + list.len;
+    while (cur < end) {
+        while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == ',')) {
+            cur++;
+        }
+        if (end - cur > 2 && cur[0] == 'W' && cur[1] == '/') {
+            cur += 2;
+        }
+        // an entity tag is a quoted string without escapes
+        const char *close = cur < end && *cur == '"'
+                            ? memchr(cur + 1, '"', end - cur - 1) : NULL;
+        if (close == NULL) {
+            return false;
+        }
+        if ((size_t)(close + 1 - cur) == etag.len
+                && memcmp(cur, etag.ptr, etag.len) == 0) {
+            return true;
+        }
+        cur = close + 1;
+    }
+    return false;
+}
+
+/*
+ * http_next_token : take the next element of a comma separated list,
+ * parameters included, with surrounding whitespace trimmed. Empty
+ * elements are skipped. Returns false at the end of the list.
+ */
+bool http_next_token(http_slice *plist, http_slice *ptok)
+{
+    const char *cur = plist->ptr;
+    const char *end = plist->ptr + plist->len;
+    while (cur < end) {
+        const char *comma = memchr(cur, ',', end - cur);
+        const char *next = comma == NULL ? end : comma;
+        const char *tend = next;
+        while (cur < tend && (*cur == ' ' || *cur == '\t')) {
+            cur++;
+        }
+        while (tend > cur && (tend[-1] == ' ' || tend[-1] == '\t')) {
+            tend--;
+        }
+        if (next < end) {
+            next++;
+        }
+        if (tend > cur) {
+            ptok->ptr = cur;
+            ptok->len = tend - cur;
+            plist->ptr = next;
+            plist->len = end - next;
+            return true;
+        }
+        cur = next;
+    }
+    plist->ptr = end;
+    plist->len = 0;
+    return false;
+}
+
+/*
+ * coding_bit : map one coding name to its bit, 0 for identity
+ */
+static unsigned coding_bit(http_slice name)
+{
+    if (http_slice_eq(name, "gzip") || http_slice_eq(name, "x-gzip")) {
+        return HTTP_ENC_GZIP;
+    }
+    if (http_slice_eq(name, "deflate")) {
+        return HTTP_ENC_DEFLATE;
+    }
+    if (http_slice_eq(name, "br")) {
+        return HTTP_ENC_BR;
+    }
+    if (http_slice_eq(name, "zstd")) {
+        return HTTP_ENC_ZSTD;
+    }
+    if (http_slice_eq(name, "identity") || name.len == 0) {
+        return 0;
+    }
+    return HTTP_ENC_OTHER;
+}
+
+/*
+ * http_content_coding : classify a Content-Encoding value. More than one
+ * coding applied on top of each other counts as HTTP_ENC_OTHER.
+ */
+unsigned http_content_coding(http_slice s)
+{
+    http_slice tok;
+    unsigned coding = 0;
+    while (http_next_token(&s, &tok)) {
+        unsigned bit = coding_bit(tok);
+        if (bit != 0) {
+            coding = coding == 0 ? bit : HTTP_ENC_OTHER;
+        }
+    }
+    return coding;
+}
+
+/*
+ * http_accept_encoding : the mask of codings an Accept-Encoding value
+ * allows. Codings with q=0 are left out, "*" stands for every coding.
+ */
+unsigned http_accept_encoding(http_slice s)
+{
+    http_slice tok;
+    unsigned mask = 0;
+    while (http_next_token(&s, &tok)) {
+        http_slice name = tok;
+        const char *semi = memchr(tok.ptr, ';', tok.len);
+        if (semi != NULL) {
+            name.len = semi - tok.ptr;
+            while (name.len > 0 && (name.ptr[name.len - 1] == ' '
+                                    || name.ptr[name.len - 1] == '\t')) {
+                name.len--;
+            }
+            // q=0, q=0.0 ... turn the coding off
+            const char *q = semi + 1;
+            const char *end = tok.ptr + tok.len;
+            while (q < end && (*q == ' ' || *q == '\t')) {
+                q++;
+            }
+            if (end - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+                q += 2;
+                while (q < end && (*q == '0' || *q == '.')) {
+                    q++;
+                }
+                if (q == end) {
+                    continue;
+                }
+            }
+        }
+        mask |= http_slice_eq(name, "*") ? HTTP_ENC_ANY : coding_bit(name);
+    }
+    return mask;
+}
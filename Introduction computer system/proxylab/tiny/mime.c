@@ -0,0 +1,200 @@
+/*
+ * mime.c - extension-keyed MIME table with a perfect hash.
+ *
+ * The extensions read at startup are placed in a power-of-two table by a
+ * seeded FNV-1a hash, trying seeds until no two of them share a slot and
+ * doubling the table if none works. A lookup then hashes the extension
+ * once and compares against the single entry in its slot. Each type also
+ * carries its Content-Type header line, formatted here once, so building
+ * response headers only copies it.
+ */
+#include "mime.h"
+#include <ctype.h>
+
+#define MIME_SEEDS 4096         /* seeds tried per table size */
+
+typedef struct {
+    char ext[MIME_EXT_MAX + 1]; // lower case, without the dot
+    mime_type *type;
+} mime_ext;
+
+/* Used when the table file cannot be read; the types tiny always knew */
+static const char *const builtin_types[] = {
+    "text/html html",
+    "image/gif gif",
+    "image/png png",
+    "image/jpeg jpg",
+    NULL
+};
+
+static mime_ext *exts;
+static size_t nexts;
+static mime_ext **slots;        // perfect hash table over exts
+static unsigned mask;           // table size - 1
+static unsigned seed;
+static mime_type *default_type;
+
+static unsigned mime_hash(const char *ext, unsigned s) {
+    unsigned h = 2166136261u ^ s;
+    for (; *ext; ext++) {
+        h ^= (unsigned char) *ext;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * compressible - text and structured formats named in the table are worth
+ * compressing
+ */
+static bool compressible(const char *name) {
+    return strncmp(name, "text/", 5) == 0 || strstr(name, "javascript")
+        || strstr(name, "json") || strstr(name, "xml");
+}
+
+/*
+ * new_type - make a type with its header line. Compressed types vary on
+ * Accept-Encoding.
+ */
+static mime_type *new_type(const char *name, bool compress) {
+    mime_type *t = Malloc(sizeof(mime_type));
+    char hdr[MAXLINE];
+
+    t->type = Malloc(strlen(name) + 1);
+    strcpy(t->type, name);
+    t->compress = compress;
+    t->hdr_len = snprintf(hdr, sizeof(hdr), "Content-Type: %s\r\n%s", name,
+                          t->compress ? "Vary: Accept-Encoding\r\n" : "");
+    t->hdr = Malloc(t->hdr_len + 1);
+    strcpy(t->hdr, hdr);
+    return t;
+}
+
+/*
+ * add_ext - map ext to type; a later line for the same extension wins
+ */
+static void add_ext(const char *ext, mime_type *type) {
+    char lower[MIME_EXT_MAX + 1];
+    size_t i, len = strlen(ext);
+
+    if (len == 0 || len > MIME_EXT_MAX) {
+        return;
+    }
+    for (i = 0; i <= len; i++) {
+        lower[i] = tolower((unsigned char) ext[i]);
+    }
+    for (i = 0; i < nexts; i++) {
+        if (strcmp(exts[i].ext, lower) == 0) {
+            exts[i].type = type;
+            return;
+        }
+    }
+    exts = Realloc(exts, (nexts + 1) * sizeof(mime_ext));
+    strcpy(exts[nexts].ext, lower);
+    exts[nexts].type = type;
+    nexts++;
+}
+
+/*
+ * add_line - parse "type ext ext ..." and add its extensions
+ */
+static void add_line(char *line) {
+    char *save, *tok;
+
+    if ((tok = strchr(line, '#')) != NULL) {
+        *tok = '\0';
+    }
+    if ((tok = strtok_r(line, " \t\r\n", &save)) == NULL) {
+        return;
+    }
+    if (strchr(tok, '/') == NULL) {
+        fprintf(stderr, "mime: ignoring bad type \"%s\"\n", tok);
+        return;
+    }
+    mime_type *type = new_type(tok, compressible(tok));
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        add_ext(tok, type);
+    }
+}
+
+/*
+ * try_seed - place every extension in a table of mask + 1 slots under
+ * seed s. Returns false on the first collision.
+ */
+static bool try_seed(unsigned s) {
+    size_t i;
+
+    memset(slots, 0, (mask + 1) * sizeof(mime_ext *));
+    for (i = 0; i < nexts; i++) {
+        mime_ext **slot = &slots[mime_hash(exts[i].ext, s) & mask];
+        if (*slot != NULL) {
+            return false;
+        }
+        *slot = &exts[i];
+    }
+    return true;
+}
+
+static void build_table(void) {
+    unsigned size = 8;
+
+    while (size < 2 * nexts) {
+        size <<= 1;
+    }
+    for (;; size <<= 1) {
+        mask = size - 1;
+        slots = Realloc(slots, size * sizeof(mime_ext *));
+        for (seed = 0; seed < MIME_SEEDS; seed++) {
+            if (try_seed(seed)) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * mime_init - load the table from path, or fall back to the built-in
+ * types if it cannot be read. Call once, before any lookup.
+ */
+void mime_init(const char *path) {
+    char line[MAXLINE];
+    FILE *fp;
+    int i;
+
+    /* Unknown extensions may be anything, binary data included */
+    default_type = new_type(MIME_DEFAULT_TYPE, false);
+    if ((fp = fopen(path, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            add_line(line);
+        }
+        fclose(fp);
+    } else {
+        fprintf(stderr, "mime: cannot read %s (%s), using built-in types\n",
+                path, strerror(errno));
+        for (i = 0; builtin_types[i] != NULL; i++) {
+            strcpy(line, builtin_types[i]);
+            add_line(line);
+        }
+    }
+    build_table();
+}
+
+/*
+ * mime_lookup - the type of filename, by the extension of its last path
+ * component, ignoring case. Never NULL.
+ */
+const mime_type *mime_lookup(const char *filename) {
+    char ext[MIME_EXT_MAX + 1];
+    const char *base = strrchr(filename, '/');
+    const char *dot = strrchr(base ? base : filename, '.');
+    size_t i, len;
+
+    if (dot == NULL || (len = strlen(dot + 1)) == 0 || len > MIME_EXT_MAX) {
+        return default_type;
+    }
+    for (i = 0; i <= len; i++) {
+        ext[i] = tolower((unsigned char) dot[1 + i]);
+    }
+    mime_ext *e = slots[mime_hash(ext, seed) & mask];
+    return e != NULL && strcmp(e->ext, ext) == 0 ? e->type : default_type;
+}
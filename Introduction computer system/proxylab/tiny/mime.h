@@ -0,0 +1,31 @@
+/*
+ * mime.h - file extension to MIME type table for tiny, loaded once at
+ *     startup from a mime.types style file: each line names a type and
+ *     the extensions that map to it, "#" starts a comment.
+ */
+#ifndef __MIME_H__
+#define __MIME_H__
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/* Default table, changed with -m on the command line */
+#define MIME_TYPES_FILE "mime.types"
+
+/* Type of files without a known extension, never compressed */
+#define MIME_DEFAULT_TYPE "text/plain"
+
+/* Longest extension looked up; longer ones get the default type */
+#define MIME_EXT_MAX 15
+
+typedef struct {
+    char *type;
+    bool compress;              // worth sending gzip-compressed
+    char *hdr;                  // "Content-Type:" line, then Vary if
+    size_t hdr_len;             // compressed variants exist
+} mime_type;
+
+void mime_init(const char *path);
+const mime_type *mime_lookup(const char *filename);
+
+#endif /* __MIME_H__ */
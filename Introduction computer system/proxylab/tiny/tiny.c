@@ -1,26 +1,64 @@
 
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content. Connections are served inline by
+ *     the accepting thread, or handed to a prethreaded pool of workers
+ *     (-w), optionally in several forked worker processes (-P). With
+ *     workers, static responses keep the connection open for further,
+ *     possibly pipelined, requests. Text is sent gzip-compressed to
+ *     clients that accept it. Static files carry an ETag and
+ *     Last-Modified, so conditional requests get 304 and single byte
+ *     ranges get 206. Content types come from the extension table in
+ *     mime.types (-m).
  *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
  */
 #include "csapp.h"
+#include "sbuf.h"
+#include "filecache.h"
+#include "fdcache.h"
+#include "cgipool.h"
+#include "cgispawn.h"
+#include "http.h"
+#include "gzip.h"
+#include "mime.h"
 #include <stdbool.h>
 
 #define HOSTLEN 256
 #define SERVLEN 8
+#define SBUFSIZE 64     /* accepted connections waiting for a worker */
+
+/* Persistent connection defaults, changed with -k and -t */
+#define KEEPALIVE_REQUESTS 100  /* requests served on one connection */
+#define KEEPALIVE_TIMEOUT 5     /* seconds to wait for the next request */
+
+/* Seconds a write may wait for a client that stopped reading */
+#define SEND_TIMEOUT 30
 
 /* Information about a connected client. */
 typedef struct {
-    struct sockaddr_in addr;    // Socket address
+    struct sockaddr_storage addr; // Socket address
     socklen_t addrlen;          // Socket address length
     int connfd;                 // Client connection file descriptor
     char host[HOSTLEN];         // Client host
     char serv[SERVLEN];         // Client service (port)
 } client_info;
 
+/* Port every acceptor listens on */
+static char *listen_port;
+
+/* Number of acceptor threads, and of worker threads (0: serve inline) */
+static int acceptors = 1;
+static int nworkers = 0;
+
+/* Connected descriptors handed from the acceptors to the workers */
+static sbuf_t conns;
+
+/* Persistent connection limits */
+static int max_requests = KEEPALIVE_REQUESTS;
+static int idle_timeout = KEEPALIVE_TIMEOUT;
+
 /* URI parsing results. */
 typedef enum {
     PARSE_ERROR,
@@ -29,24 +67,25 @@ typedef enum {
 } parse_result;
 
 /*
- * read_requesthdrs - read HTTP request headers
- * Returns true if an error occurred, or false otherwise.
+ * want_keepalive - decide from the request version and its Connection
+ * header whether the client wants the connection kept open
  */
-bool read_requesthdrs(rio_t *rp) {
-    char buf[MAXLINE];
+bool want_keepalive(char version, http_request *req) {
+    http_slice list = req->field[HDR_CONNECTION];
+    http_slice tok;
+    bool keep = version == '1';     /* HTTP/1.1 is persistent by default */
 
-    do {
-        if (rio_readlineb(rp, buf, MAXLINE) <= 0) {
-            return true;
+    while (http_next_token(&list, &tok)) {
+        if (http_slice_eq(tok, "close")) {
+            return false;
         }
-
-        printf("%s", buf);
-    } while(strncmp(buf, "\r\n", sizeof("\r\n")));
-
-    return false;
+        if (http_slice_eq(tok, "keep-alive")) {
+            keep = true;
+        }
+    }
+    return keep;
 }
 
-
 /*
  * parse_uri - parse URI into filename and CGI args
  *
@@ -97,78 +136,456 @@ parse_result parse_uri(char *uri, char *filename, char *cgiargs) {
     return PARSE_STATIC;
 }
 
+/* Start of a static response, up to where static_headers take over,
+   indexed by [request was HTTP/1.1][connection stays open] */
+static const char *const static_status[2][2] = {
+    { "HTTP/1.0 200 OK\r\n" \
+      "Server: Tiny Web Server\r\n" \
+      "Connection: close\r\n",
+      "HTTP/1.0 200 OK\r\n" \
+      "Server: Tiny Web Server\r\n" \
+      "Connection: keep-alive\r\n" },
+    { "HTTP/1.1 200 OK\r\n" \
+      "Server: Tiny Web Server\r\n" \
+      "Connection: close\r\n",
+      "HTTP/1.1 200 OK\r\n" \
+      "Server: Tiny Web Server\r\n" \
+      "Connection: keep-alive\r\n" }
+};
+
+/* Outcome of a helper that may leave a static request to its caller */
+typedef enum {
+    SERVE_DECLINED,             // nothing sent, the caller answers
+    SERVE_SENT,                 // the whole response was written
+    SERVE_FAILED                // building or writing it failed
+} serve_result;
+
+/* What the response to a static request depends on besides the file */
+typedef struct {
+    int fd;                     // client connection
+    char version;               // minor version of the request
+    bool keep;                  // connection stays open
+    bool more;                  // another pipelined request is queued
+    bool conditional;           // sent If-None-Match, -Modified-Since, Range
+    const char *status;         // 200 status lines, from static_status
+    http_request *req;
+} static_req;
+
+/* Validators of one representation of a file: the file's stat and the
+   content coding of the variant, so each variant has its own ETag */
+typedef struct {
+    char hdr[128];              // the ETag and Last-Modified lines
+    size_t hdr_len;
+    http_slice etag;            // the values, inside hdr
+    http_slice last_modified;   // IMF-fixdate
+    time_t mtime;
+    unsigned encoding;          // HTTP_ENC_* of the variant, 0: identity
+} validators;
+
+/*
+ * make_validators - derive the ETag and Last-Modified of a file's variant
+ * from its inode, size and modification time
+ */
+void make_validators(validators *v, ino_t ino, off_t size,
+        struct timespec mtime, unsigned encoding) {
+    static const char etag_name[] = "ETag: ";
+    static const char lm_name[] = "\r\nLast-Modified: ";
+    char etag[64], date[32];
+    struct tm tm;
+
+    snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx%s\"",
+             (unsigned long long) ino, (unsigned long long) size,
+             (unsigned long long) mtime.tv_sec * 1000000000ULL
+                 + mtime.tv_nsec,
+             encoding == HTTP_ENC_GZIP ? "-gz" : "");
+    gmtime_r(&mtime.tv_sec, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    v->hdr_len = snprintf(v->hdr, sizeof(v->hdr), "%s%s%s%s\r\n",
+                          etag_name, etag, lm_name, date);
+    v->etag.ptr = v->hdr + sizeof(etag_name) - 1;
+    v->etag.len = strlen(etag);
+    v->last_modified.ptr = v->etag.ptr + v->etag.len + sizeof(lm_name) - 1;
+    v->last_modified.len = strlen(date);
+    v->mtime = mtime.tv_sec;
+    v->encoding = encoding;
+}
+
 /*
- * get_filetype - derive file type from file name
- *
- * filename - The file name. Must be a NUL-terminated string.
- * filetype - The buffer in which the file type will be storaged. Must be at
- * least MAXLINE bytes. Will be a NUL-terminated string.
+ * static_headers - build the headers that depend on the file into buf,
+ * which holds MAXBUF bytes, from the type's prebuilt Content-Type (and
+ * Vary) lines and the validators; only the length is formatted here.
+ * encoding is the body's content coding. Only the identity variant offers
+ * ranges. Returns their length, or 0 on overflow.
+ */
+size_t static_headers(char *buf, const mime_type *mt, off_t filesize,
+        unsigned encoding, const validators *v) {
+    static const char ranges[] = "Accept-Ranges: bytes\r\n";
+    static const char gzip[] = "Content-Encoding: gzip\r\n";
+    int buflen;
+
+    buflen = snprintf(buf, MAXBUF, "Content-Length: %lld\r\n",
+                      (long long) filesize);
+    if (buflen + mt->hdr_len + v->hdr_len + sizeof(ranges)
+            + sizeof(gzip) + 2 >= MAXBUF) {
+        return 0; // Overflow!
+    }
+    memcpy(buf + buflen, mt->hdr, mt->hdr_len);
+    buflen += mt->hdr_len;
+    memcpy(buf + buflen, v->hdr, v->hdr_len);
+    buflen += v->hdr_len;
+    if (v->encoding == 0) {
+        memcpy(buf + buflen, ranges, sizeof(ranges) - 1);
+        buflen += sizeof(ranges) - 1;
+    }
+    if (encoding == HTTP_ENC_GZIP) {
+        memcpy(buf + buflen, gzip, sizeof(gzip) - 1);
+        buflen += sizeof(gzip) - 1;
+    }
+    memcpy(buf + buflen, "\r\n", 3);
+    return buflen + 2;
+}
+
+/*
+ * serve_cached - send a file cache entry: the status lines, then its
+ * headers and contents in the same gathered write. With more set another
+ * pipelined response follows, so a partial segment may wait for it.
+ * Returns false if the write failed.
  */
-void get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html")) {
-        strcpy(filetype, "text/html");
-    } else if (strstr(filename, ".gif")) {
-        strcpy(filetype, "image/gif");
-    } else if (strstr(filename, ".png")) {
-        strcpy(filetype, "image/png");
-    } else if (strstr(filename, ".jpg")) {
-        strcpy(filetype, "image/jpeg");
+bool serve_cached(int fd, fc_entry *e, const char *status, bool more) {
+    rio_wbuf_t wb;
+
+    rio_wbufinit(&wb, fd);
+    rio_wbufref(&wb, status, strlen(status));
+    rio_wbufref(&wb, e->data, e->size);
+    if (rio_wbufflush(&wb, more) < 0) {
+        fprintf(stderr, "Error writing cached file \"%s\" to client\n",
+                e->path);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * send_file - send status and hdr, then len bytes of srcfd from offset,
+ * with the socket corked so the headers leave in the same segment as the
+ * start of the file, which sendfile() hands over straight from the page
+ * cache. Returns false if a write failed or the file ended early; the
+ * client then has a short body and the connection must close.
+ */
+bool send_file(int fd, const char *status, char *hdr, size_t hdr_len,
+        int srcfd, off_t offset, size_t len, char *filename) {
+    rio_wbuf_t wb;
+    bool ok = false;
+
+    rio_cork(fd, 1);
+    rio_wbufinit(&wb, fd);
+    rio_wbufref(&wb, status, strlen(status));
+    rio_wbufref(&wb, hdr, hdr_len);
+    if (rio_wbufflush(&wb, 1) < 0) {
+        fprintf(stderr, "Error writing static response headers to client\n");
+    } else if (rio_sendfile(fd, srcfd, offset, len) < 0) {
+        /* Send response body to client */
+        fprintf(stderr, "Error writing static file \"%s\" to client\n",
+                filename);
     } else {
-        strcpy(filetype, "text/plain");
+        ok = true;
     }
+    rio_cork(fd, 0);
+    return ok;
 }
 
+/*
+ * send_bodiless - send a response made of status lines and headers only.
+ * Returns false if the write failed.
+ */
+bool send_bodiless(static_req *r, char *buf, size_t buflen) {
+    rio_wbuf_t wb;
+
+    printf("Response headers:\n%s", buf);
+    rio_wbufinit(&wb, r->fd);
+    rio_wbufref(&wb, buf, buflen);
+    if (rio_wbufflush(&wb, r->more) < 0) {
+        fprintf(stderr, "Error writing static response headers to client\n");
+        return false;
+    }
+    return true;
+}
 
 /*
- * serve_static - copy a file back to the client
+ * not_modified - answer 304 if the client's copy is current: it names the
+ * variant's ETag in If-None-Match or, without that header, its
+ * If-Modified-Since is not older than the file. Returns SERVE_DECLINED
+ * if the copy is stale.
  */
-void serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp;
-    char filetype[MAXLINE];
-    char buf[MAXBUF];
-    size_t buflen;
+serve_result not_modified(static_req *r, const validators *v, bool vary) {
+    http_slice inm = r->req->field[HDR_IF_NONE_MATCH];
+    time_t since;
 
-    get_filetype(filename, filetype);
+    if (inm.len > 0) {
+        if (!http_etag_list_match(inm, v->etag)) {
+            return SERVE_DECLINED;
+        }
+    } else if (!http_parse_date(r->req->field[HDR_IF_MODIFIED_SINCE],
+                                &since) || v->mtime > since) {
+        return SERVE_DECLINED;
+    }
 
-    /* Send response headers to client */
-    buflen = snprintf(buf, MAXBUF,
-            "HTTP/1.0 200 OK\r\n" \
+    char buf[MAXBUF];
+    int buflen = snprintf(buf, MAXBUF,
+            "HTTP/1.%c 304 Not Modified\r\n" \
             "Server: Tiny Web Server\r\n" \
-            "Connection: close\r\n" \
-            "Content-Length: %d\r\n" \
-            "Content-Type: %s\r\n\r\n", \
-            filesize, filetype);
+            "Connection: %s\r\n" \
+            "%s%s\r\n",
+            r->version, r->keep ? "keep-alive" : "close", v->hdr,
+            vary ? "Vary: Accept-Encoding\r\n" : "");
     if (buflen >= MAXBUF) {
-        return; // Overflow!
+        return SERVE_FAILED; // Overflow!
     }
+    return send_bodiless(r, buf, buflen) ? SERVE_SENT : SERVE_FAILED;
+}
 
-    printf("Response headers:\n%s", buf);
+/*
+ * serve_range - answer a single-range request for the identity variant of
+ * a file of size bytes, whose contents are at body if it is cached and
+ * in srcfd otherwise: 206 with the range, or 416 if it lies past the end.
+ * Returns SERVE_DECLINED if the whole file should be sent instead, because
+ * there is no usable Range or If-Range names another version of the file.
+ */
+serve_result serve_range(static_req *r, char *filename, const mime_type *mt,
+        const validators *v, off_t size, const char *body, int srcfd) {
+    http_slice range = r->req->field[HDR_RANGE];
+    http_slice cond = r->req->field[HDR_IF_RANGE];
+    size_t first, last;
+    char status[MAXBUF], buf[MAXBUF];
+    int buflen;
 
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing static response headers to client\n");
+    if (range.len == 0 || (cond.len > 0
+                           && !http_if_range_match(cond, v->etag,
+                                                   v->last_modified))) {
+        return SERVE_DECLINED;
+    }
+    switch (http_parse_range(range, size, &first, &last)) {
+    case HTTP_RANGE_NONE:
+        return SERVE_DECLINED;
+    case HTTP_RANGE_UNSATISFIABLE:
+        buflen = snprintf(buf, MAXBUF,
+                "HTTP/1.%c 416 Range Not Satisfiable\r\n" \
+                "Server: Tiny Web Server\r\n" \
+                "Connection: %s\r\n" \
+                "Content-Range: bytes */%lld\r\n" \
+                "Content-Length: 0\r\n\r\n",
+                r->version, r->keep ? "keep-alive" : "close",
+                (long long) size);
+        if (buflen >= MAXBUF) {
+            return SERVE_FAILED; // Overflow!
+        }
+        return send_bodiless(r, buf, buflen) ? SERVE_SENT : SERVE_FAILED;
+    case HTTP_RANGE_OK:
+        break;
     }
 
+    size_t len = last - first + 1;
+    buflen = snprintf(status, MAXBUF,
+            "HTTP/1.%c 206 Partial Content\r\n" \
+            "Server: Tiny Web Server\r\n" \
+            "Connection: %s\r\n" \
+            "Content-Range: bytes %zu-%zu/%lld\r\n",
+            r->version, r->keep ? "keep-alive" : "close",
+            first, last, (long long) size);
+    if (buflen >= MAXBUF
+            || (buflen = static_headers(buf, mt, len, 0, v)) == 0) {
+        return SERVE_FAILED; // Overflow!
+    }
+    printf("Response headers:\n%s%s", status, buf);
+    if (body == NULL) {
+        return send_file(r->fd, status, buf, buflen, srcfd, first, len,
+                         filename) ? SERVE_SENT : SERVE_FAILED;
+    }
 
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    if (rio_writen(fd, srcp, filesize) < 0) {
+    rio_wbuf_t wb;
+    rio_wbufinit(&wb, r->fd);
+    rio_wbufref(&wb, status, strlen(status));
+    rio_wbufref(&wb, buf, buflen);
+    rio_wbufref(&wb, body + first, len);
+    if (rio_wbufflush(&wb, r->more) < 0) {
         fprintf(stderr, "Error writing static file \"%s\" to client\n",
                 filename);
+        return SERVE_FAILED;
     }
+    return SERVE_SENT;
+}
 
-    Munmap(srcp, filesize);
+/*
+ * serve_entry - answer a request from a file cache entry: 304 or a range
+ * when the request asks for one, the whole entry otherwise. Returns false
+ * if the response could not be sent.
+ */
+bool serve_entry(static_req *r, fc_entry *e) {
+    serve_result res;
+
+    if (r->conditional) {
+        const mime_type *mt = mime_lookup(e->path);
+        validators v;
+
+        make_validators(&v, e->ino, e->filesize, e->mtime, e->encoding);
+        if ((res = not_modified(r, &v, mt->compress)) != SERVE_DECLINED) {
+            return res == SERVE_SENT;
+        }
+        if (e->encoding == 0
+                && (res = serve_range(r, e->path, mt, &v, e->filesize,
+                                      e->data + e->hdr_len, -1))
+                   != SERVE_DECLINED) {
+            return res == SERVE_SENT;
+        }
+    }
+    return serve_cached(r->fd, e, r->status, r->more);
 }
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_gzip - answer a client that accepts gzip with the file's gzip
+ * variant: a precompressed filename.gz sibling that is not older than the
+ * file, or else the file compressed here once. The result is cached under
+ * the gzip coding of filename, so it is validated against filename
+ * itself. Returns SERVE_DECLINED if the caller should send the plain
+ * file.
+ */
+serve_result serve_gzip(static_req *r, char *filename, fd_entry *fe,
+        const mime_type *mt) {
+    char gzname[MAXLINE + sizeof(".gz")];
+    char buf[MAXBUF];
+    size_t buflen;
+    serve_result res;
+    validators v;
+    fc_entry *e;
+
+    make_validators(&v, fe->st.st_ino, fe->st.st_size, fe->st.st_mtim,
+                    HTTP_ENC_GZIP);
+    snprintf(gzname, sizeof(gzname), "%s.gz", filename);
+    fd_entry *gz = fdcache_open(gzname);
+    if (gz != NULL && S_ISREG(gz->st.st_mode)
+            && (gz->st.st_mtim.tv_sec > fe->st.st_mtim.tv_sec
+                || (gz->st.st_mtim.tv_sec == fe->st.st_mtim.tv_sec
+                    && gz->st.st_mtim.tv_nsec >= fe->st.st_mtim.tv_nsec))) {
+        if (r->conditional
+                && (res = not_modified(r, &v, true)) != SERVE_DECLINED) {
+            fdcache_put(gz);
+            return res;
+        }
+        buflen = static_headers(buf, mt, gz->st.st_size, HTTP_ENC_GZIP,
+                                &v);
+        if (buflen == 0) {
+            fdcache_put(gz);
+            return SERVE_FAILED; // Overflow!
+        }
+        printf("Response headers:\n%s%s", r->status, buf);
+        e = filecache_load(filename, HTTP_ENC_GZIP, &fe->st, buf, buflen,
+                           gzname, gz->fd, gz->st.st_size);
+        if (e != NULL) {
+            res = serve_cached(r->fd, e, r->status, r->more)
+                  ? SERVE_SENT : SERVE_FAILED;
+            filecache_put(e);
+        } else {
+            res = send_file(r->fd, r->status, buf, buflen, gz->fd, 0,
+                            gz->st.st_size, gzname)
+                  ? SERVE_SENT : SERVE_FAILED;
+        }
+        fdcache_put(gz);
+        return res;
+    }
+    if (gz != NULL) {
+        fdcache_put(gz);
+    }
+
+    /* Compress only what will be cached, never once per request */
+    if (!filecache_fits(fe->st.st_size)) {
+        return SERVE_DECLINED;
+    }
+    if (r->conditional
+            && (res = not_modified(r, &v, true)) != SERVE_DECLINED) {
+        return res;
+    }
+    size_t zlen;
+    char *z = gzip_file(fe->fd, fe->st.st_size, &zlen);
+    if (z == NULL) {
+        return SERVE_DECLINED;
+    }
+    if (zlen < (size_t) fe->st.st_size) {
+        buflen = static_headers(buf, mt, zlen, HTTP_ENC_GZIP, &v);
+        e = buflen ? filecache_add(filename, HTTP_ENC_GZIP, &fe->st,
+                                   buf, buflen, z, zlen) : NULL;
+    } else {
+        /* No gain: remember the plain file as the answer for gzip too */
+        buflen = static_headers(buf, mt, fe->st.st_size, 0, &v);
+        e = buflen ? filecache_load(filename, HTTP_ENC_GZIP, &fe->st,
+                                    buf, buflen, NULL, fe->fd,
+                                    fe->st.st_size)
+                   : NULL;
+    }
+    Free(z);
+    if (e == NULL) {
+        return SERVE_DECLINED;
+    }
+    printf("Response headers:\n%s%.*s", r->status, (int) e->hdr_len,
+           e->data);
+    res = serve_cached(r->fd, e, r->status, r->more)
+          ? SERVE_SENT : SERVE_FAILED;
+    filecache_put(e);
+    return res;
+}
+
+/*
+ * serve_static - copy a file back to the client from the open descriptor
+ * in fe. Text goes through serve_gzip when the client accepts gzip. Small
+ * files are read into the file cache and sent from there, others are sent
+ * with send_file. A current client copy gets 304, a Range gets part of
+ * the file. Returns false if the response could not be built or sent in
+ * full.
+ */
+bool serve_static(static_req *r, char *filename, fd_entry *fe,
+        bool gzip_ok) {
+    const mime_type *mt = mime_lookup(filename);
+    char buf[MAXBUF];
+    size_t buflen;
+    serve_result res;
+    validators v;
+
+    if (mt->compress && gzip_ok
+            && (res = serve_gzip(r, filename, fe, mt)) != SERVE_DECLINED) {
+        return res == SERVE_SENT;
+    }
+
+    make_validators(&v, fe->st.st_ino, fe->st.st_size, fe->st.st_mtim, 0);
+    if (r->conditional
+            && ((res = not_modified(r, &v, mt->compress)) != SERVE_DECLINED
+                || (res = serve_range(r, filename, mt, &v, fe->st.st_size,
+                                      NULL, fe->fd)) != SERVE_DECLINED)) {
+        return res == SERVE_SENT;
+    }
+
+    buflen = static_headers(buf, mt, fe->st.st_size, 0, &v);
+    if (buflen == 0) {
+        return false; // Overflow!
+    }
+    printf("Response headers:\n%s%s", r->status, buf);
+
+    fc_entry *e = filecache_load(filename, 0, &fe->st, buf, buflen,
+                                 NULL, fe->fd, fe->st.st_size);
+    if (e != NULL) {
+        bool ok = serve_cached(r->fd, e, r->status, r->more);
+        filecache_put(e);
+        return ok;
+    }
+    return send_file(r->fd, r->status, buf, buflen, fe->fd, 0,
+                     fe->st.st_size, filename);
+}
+
+/*
+ * serve_dynamic - run a CGI program on behalf of the client, on a pooled
+ * worker if its name marks it as a pool program
  */
 void serve_dynamic(int fd, char *filename, char *cgiargs) {
     char buf[MAXLINE];
     size_t buflen;
-    char *emptylist[] = { NULL };
 
     /* Format first part of HTTP response */
     buflen = snprintf(buf, MAXLINE,
@@ -178,19 +595,37 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
         return; // Overflow!
     }
 
+    char *response;
+    ssize_t n = cgipool_run(filename, cgiargs, &response);
+    if (n >= 0) {
+        rio_wbuf_t wb;
+        rio_wbufinit(&wb, fd);
+        rio_wbufref(&wb, buf, buflen);
+        rio_wbufref(&wb, response, n);
+        if (rio_wbufflush(&wb, 0) < 0) {
+            fprintf(stderr, "Error writing dynamic response to client\n");
+        }
+        Free(response);
+        return;
+    }
+
     /* Write first part of HTTP response */
     if (rio_writen(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing dynamic response headers to client\n");
         return;
     }
 
-    if (Fork() == 0) { /* Child */
-        /* Real server would set all CGI vars here */
-        setenv("QUERY_STRING", cgiargs, 1);
-        Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */
-        Execve(filename, emptylist, environ); /* Run CGI program */
+    /* Real server would set all CGI vars here */
+    char query[MAXLINE + sizeof("QUERY_STRING=")];
+    snprintf(query, sizeof(query), "QUERY_STRING=%s", cgiargs);
+    char *cgienv[] = { query, NULL };
+
+    /* The child writes straight to the client; nobody waits for it, the
+       reaper thread collects it once it exits */
+    if (spawn_cgi(filename, -1, fd, cgienv) < 0) {
+        fprintf(stderr, "Error running \"%s\": %s\n",
+                filename, strerror(errno));
     }
-    Wait(NULL); /* Parent waits for and reaps child */
 }
 
 /*
@@ -242,24 +677,14 @@ void clienterror(int fd, char *cause, char *errnum,
 }
 
 /*
- * serve - handle one HTTP request/response transaction
+ * serve_request - handle one HTTP request/response transaction on the
+ * connection. Returns true if the connection may carry another request.
  */
-void serve(client_info *client) {
-    // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    Getnameinfo((SA *) &client->addr, client->addrlen,
-            client->host, sizeof(client->host),
-            client->serv, sizeof(client->serv),
-            0);
-    printf("Accepted connection from %s:%s\n", client->host, client->serv);
-
-    rio_t rio;
-    rio_readinitb(&rio, client->connfd);
-
+bool serve_request(client_info *client, rio_t *rio, bool last) {
     /* Read request line */
     char buf[MAXLINE];
-    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
-        return;
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
+        return false;
     }
 
     printf("%s", buf);
@@ -275,20 +700,33 @@ void serve(client_info *client) {
             || (version != '0' && version != '1')) {
         clienterror(client->connfd, buf, "400", "Bad Request",
                 "Tiny received a malformed request");
-        return;
+        return false;
     }
 
     /* Check that the method is GET */
     if (strncmp(method, "GET", sizeof("GET"))) {
         clienterror(client->connfd, method, "501", "Not Implemented",
                 "Tiny does not implement this method");
-        return;
+        return false;
     }
 
-    /* Check if reading request headers caused an error */
-    if (read_requesthdrs(&rio)) {
-        return;
+    /* Read the request headers; stop on an error or an oversized block */
+    http_request req;
+    if (http_read_request(rio, &req) < 0) {
+        return false;
     }
+    printf("%.*s\r\n", (int) req.len, req.buf);
+
+    bool keep = !last && want_keepalive(version, &req);
+    const char *status = static_status[version == '1'][keep];
+
+    /* Let pipelined responses share segments while requests are queued */
+    bool more = keep && rio->rio_cnt > 0;
+
+    /* identity is all we offer besides gzip, and all we take ranges of */
+    bool gzip_ok = req.field[HDR_RANGE].len == 0
+                   && (http_accept_encoding(req.field[HDR_ACCEPT_ENCODING])
+                       & HTTP_ENC_GZIP) != 0;
 
     /* Parse URI from GET request */
     char filename[MAXLINE], cgiargs[MAXLINE];
@@ -296,7 +734,57 @@ void serve(client_info *client) {
     if (result == PARSE_ERROR) {
         clienterror(client->connfd, uri, "400", "Bad Request",
                 "Tiny could not parse the request URI");
-        return;
+        return false;
+    }
+
+    if (result == PARSE_STATIC) { /* Serve static content */
+        static_req r = {
+            .fd = client->connfd,
+            .version = version,
+            .keep = keep,
+            .more = more,
+            .conditional = req.field[HDR_IF_NONE_MATCH].len > 0
+                           || req.field[HDR_IF_MODIFIED_SINCE].len > 0
+                           || req.field[HDR_RANGE].len > 0,
+            .status = status,
+            .req = &req
+        };
+
+        /* A cached file that has not changed needs no filesystem calls */
+        fc_entry *e = NULL;
+        if (gzip_ok) {
+            e = filecache_get(filename, HTTP_ENC_GZIP);
+        }
+        if (e == NULL && !(gzip_ok && mime_lookup(filename)->compress)) {
+            e = filecache_get(filename, 0);
+        }
+        if (e != NULL) {
+            keep = serve_entry(&r, e) && keep;
+            filecache_put(e);
+            return keep;
+        }
+
+        /* Open the file, or reuse a descriptor opened earlier */
+        fd_entry *fe = fdcache_open(filename);
+        if (fe == NULL) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                clienterror(client->connfd, filename, "404", "Not found",
+                        "Tiny couldn't find this file");
+            } else {
+                clienterror(client->connfd, filename, "403", "Forbidden",
+                        "Tiny couldn't read the file");
+            }
+            return false;
+        }
+        if (!(S_ISREG(fe->st.st_mode)) || !(S_IRUSR & fe->st.st_mode)) {
+            clienterror(client->connfd, filename, "403", "Forbidden",
+                    "Tiny couldn't read the file");
+            keep = false;
+        } else {
+            keep = serve_static(&r, filename, fe, gzip_ok) && keep;
+        }
+        fdcache_put(fe);
+        return keep;
     }
 
     /* Attempt to stat the file */
@@ -304,37 +792,57 @@ void serve(client_info *client) {
     if (stat(filename, &sbuf) < 0) {
         clienterror(client->connfd, filename, "404", "Not found",
                 "Tiny couldn't find this file");
-        return;
+        return false;
     }
 
-    if (result == PARSE_STATIC) { /* Serve static content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            clienterror(client->connfd, filename, "403", "Forbidden",
-                    "Tiny couldn't read the file");
-            return;
-        }
-        serve_static(client->connfd, filename, sbuf.st_size);
-    } else { /* Serve dynamic content */
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-            clienterror(client->connfd, filename, "403", "Forbidden",
-                    "Tiny couldn't run the CGI program");
-            return;
-        }
-        serve_dynamic(client->connfd, filename, cgiargs);
+    /* Serve dynamic content; its end is marked by closing the connection */
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
+        clienterror(client->connfd, filename, "403", "Forbidden",
+                "Tiny couldn't run the CGI program");
+        return false;
     }
+    serve_dynamic(client->connfd, filename, cgiargs);
+    return false;
 }
 
-int main(int argc, char **argv) {
-    int listenfd;
+/*
+ * serve - handle the requests of one connection, until the client closes
+ * it, asks to close it, stays idle too long or reaches max_requests
+ */
+void serve(client_info *client) {
+    // Get some extra info about the client (hostname/port)
+    // This is optional, but it's nice to know who's connected
+    Getnameinfo((SA *) &client->addr, client->addrlen,
+            client->host, sizeof(client->host),
+            client->serv, sizeof(client->serv),
+            NI_NUMERICHOST | NI_NUMERICSERV);
+    printf("Accepted connection from %s:%s\n", client->host, client->serv);
 
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
+    /* Idle timeout: a read that waits this long fails; a write to a
+       client that stopped reading fails too, instead of holding the
+       worker */
+    set_sock_timeouts(client->connfd, idle_timeout * 1000,
+                      SEND_TIMEOUT * 1000);
 
-    listenfd = Open_listenfd(argv[1]);
+    /* One rio_t for the whole connection, so bytes of pipelined requests
+       read ahead stay buffered for the next iteration */
+    rio_t rio;
+    rio_readinitb(&rio, client->connfd);
 
+    /* Served inline, the connection holds the accepting thread, which must
+       not wait on an idle client while others queue behind it */
+    int limit = nworkers > 0 ? max_requests : 1;
+    int served = 0;
+    while (serve_request(client, &rio, ++served >= limit)) {
+        ;
+    }
+}
+
+/*
+ * accept_loop - accept connections on listenfd; serve them one at a time,
+ * or queue them for the worker threads when there are any
+ */
+void accept_loop(int listenfd) {
     while (1) {
         /* Allocate space on the stack for client info */
         client_info client_data;
@@ -344,11 +852,195 @@ int main(int argc, char **argv) {
         client->addrlen = sizeof(client->addr);
 
         /* Accept() will block until a client connects to the port */
-        client->connfd = Accept(listenfd,
+        client->connfd = Accept_cloexec(listenfd,
                 (SA *) &client->addr, &client->addrlen);
 
+        if (nworkers > 0) {
+            /* Blocks while every worker is busy and the buffer is full */
+            sbuf_insert(&conns, client->connfd);
+            continue;
+        }
+
         /* Connection is established; serve client */
         serve(client);
         Close(client->connfd);
     }
 }
+
+/*
+ * worker - thread routine for -w: take connections off the shared buffer
+ * and serve them until the process exits
+ */
+void *worker(void *vargp) {
+    (void) vargp;
+    Pthread_detach(Pthread_self());
+
+    while (1) {
+        client_info client_data;
+        client_info *client = &client_data;
+
+        client->connfd = sbuf_remove(&conns);
+        client->addrlen = sizeof(client->addr);
+        if (getpeername(client->connfd,
+                    (SA *) &client->addr, &client->addrlen) < 0) {
+            /* Peer already gone */
+            Close(client->connfd);
+            continue;
+        }
+
+        serve(client);
+        Close(client->connfd);
+    }
+    return NULL;
+}
+
+/*
+ * acceptor - thread routine for -a: every acceptor opens its own
+ * SO_REUSEPORT socket, pins itself to a core and runs accept_loop
+ */
+void *acceptor(void *vargp) {
+    int index = (int) (long) vargp;
+    int listenfd = Open_reuseport_listenfd(listen_port);
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu > 0 && pin_cpu(index % ncpu) < 0) {
+        fprintf(stderr, "acceptor %d: pin_cpu failed: %s\n",
+                index, strerror(errno));
+    }
+    accept_loop(listenfd);
+    return NULL;
+}
+
+/*
+ * run_server - start the worker threads, then accept on listenfd, or on
+ * per-acceptor sockets when acceptors > 1. Never returns.
+ */
+void run_server(int listenfd) {
+    pthread_t tid;
+    int i;
+
+    /* First, so every later thread inherits SIGCHLD blocked */
+    reaper_start(cgipool_reaped);
+
+    if (nworkers > 0) {
+        sbuf_init(&conns, SBUFSIZE);
+        for (i = 0; i < nworkers; i++) {
+            Pthread_create(&tid, NULL, worker, NULL);
+        }
+    }
+
+    if (acceptors > 1) {
+        /* One listening socket per acceptor, balanced by the kernel */
+        for (i = 0; i < acceptors; i++) {
+            Pthread_create(&tid, NULL, acceptor, (void *) (long) i);
+        }
+        Pthread_exit(NULL);
+    }
+
+    accept_loop(listenfd);
+}
+
+/*
+ * spawn_server - fork one worker process running run_server
+ */
+pid_t spawn_server(int listenfd) {
+    pid_t pid;
+    if ((pid = Fork()) == 0) {
+        run_server(listenfd);
+        exit(0);
+    }
+    return pid;
+}
+
+int main(int argc, char **argv) {
+    int processes = 0;
+    long cachesize = FILECACHE_SIZE;
+    int cgiworkers = CGIPOOL_WORKERS;
+    char *mimefile = MIME_TYPES_FILE;
+    int listenfd = -1;
+    int opt;
+
+    /* Check command line args */
+    while ((opt = getopt(argc, argv, "a:w:P:c:g:k:t:m:")) != -1) {
+        switch (opt) {
+        case 'a':
+            acceptors = atoi(optarg);
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'P':
+            processes = atoi(optarg);
+            break;
+        case 'c':
+            cachesize = atol(optarg);
+            break;
+        case 'g':
+            cgiworkers = atoi(optarg);
+            break;
+        case 'k':
+            max_requests = atoi(optarg);
+            break;
+        case 't':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'm':
+            mimefile = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || acceptors < 1 || nworkers < 0
+            || processes < 0 || cachesize < 0 || cgiworkers < 0
+            || max_requests < 1 || idle_timeout < 1) {
+        fprintf(stderr, "usage: %s [-a acceptors] [-w workers] "
+                "[-P processes] [-c cachebytes] [-g cgiworkers] "
+                "[-k requests] [-t idle_secs] [-m mimetypes] <port>\n",
+                argv[0]);
+        exit(1);
+    }
+    listen_port = argv[optind];
+
+    /* A client that hangs up mid-response must not kill the server */
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* Forked workers each get their own copy of the file cache */
+    mime_init(mimefile);
+    filecache_init(cachesize);
+    fdcache_init();
+    cgipool_init(cgiworkers);
+
+    /* With several acceptors each one opens its own socket instead */
+    if (acceptors == 1) {
+        listenfd = Open_listenfd(listen_port);
+        fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    }
+
+    if (processes == 0) {
+        run_server(listenfd);
+        return 0;
+    }
+
+    /* Forked workers share listenfd (or the SO_REUSEPORT group); the
+       parent only replaces the ones that die */
+    int i;
+    for (i = 0; i < processes; i++) {
+        spawn_server(listenfd);
+    }
+    while (1) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("wait error");
+        }
+        fprintf(stderr, "worker %d exited (status %d), restarting\n",
+                (int) pid, status);
+        spawn_server(listenfd);
+    }
+}
@@ -0,0 +1,141 @@
+/*                                                                            *
+ *  tunnel.c                                                                  *
+ *  this file relays CONNECT tunnels for the web proxy  . :)                  *
+ *  bytes move socket -> pipe -> socket with splice(), so tunnel payload      *
+ *  never goes through user space. a poll loop drives both directions on      *
+ *  non-blocking descriptors, and a half-close is passed on with shutdown()   *
+ *                                                                            *
+ */
+#define _GNU_SOURCE     /* splice, pipe2; csapp.h is not used here */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tunnel.h"
+
+/* largest chunk moved by one splice call */
+#define SPLICE_CHUNK 65536
+
+/* one direction of the tunnel */
+typedef struct {
+    int src;
+    int dst;
+    int pipefd[2];
+    size_t inpipe;      // bytes sitting in the pipe
+    bool eof;           // src has been read to EOF
+    bool done;          // eof and everything passed on, dst shut down
+} half_t;
+
+/*
+ * half_pump : move what is available src -> pipe -> dst without blocking.
+ * Returns -1 on a hard error, 0 otherwise.
+ */
+static int half_pump(half_t *h)
+{
+    ssize_t n;
+
+    if (h->done) {
+        return 0;
+    }
+    if (!h->eof && h->inpipe < SPLICE_CHUNK) {
+        n = splice(h->src, NULL, h->pipefd[1], NULL, SPLICE_CHUNK,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            h->inpipe += n;
+        } else if (n == 0) {
+            h->eof = true;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+    }
+    while (h->inpipe > 0) {
+        n = splice(h->pipefd[0], NULL, h->dst, NULL, h->inpipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            h->inpipe -= n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    if (h->eof && h->inpipe == 0) {
+        shutdown(h->dst, SHUT_WR);
+        h->done = true;
+    }
+    return 0;
+}
+
+static short half_events(const half_t *h, bool as_src)
+{
+    if (h->done) {
+        return 0;
+    }
+    if (as_src) {
+        return !h->eof && h->inpipe < SPLICE_CHUNK ? POLLIN : 0;
+    }
+    return h->inpipe > 0 ? POLLOUT : 0;
+}
+
+/*
+ * tunnel_relay : relay bytes between fd1 and fd2 until both sides have
+ * closed, an error occurs, or nothing moves for idle_timeout_ms
+ * (0 waits forever). Returns 0 on a clean finish and -1 otherwise.
+ * Both descriptors are left non-blocking; the caller closes them.
+ */
+int tunnel_relay(int fd1, int fd2, int idle_timeout_ms)
+{
+    half_t up = { fd1, fd2, { -1, -1 }, 0, false, false };
+    half_t down = { fd2, fd1, { -1, -1 }, 0, false, false };
+    int rc = -1;
+
+    if (pipe2(up.pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(down.pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        goto out;
+    }
+    fcntl(fd1, F_SETFL, fcntl(fd1, F_GETFL) | O_NONBLOCK);
+    fcntl(fd2, F_SETFL, fcntl(fd2, F_GETFL) | O_NONBLOCK);
+
+    while (!(up.done && down.done)) {
+        struct pollfd pfd[2];
+        pfd[0].fd = fd1;
+        pfd[0].events = half_events(&up, true) | half_events(&down, false);
+        pfd[1].fd = fd2;
+        pfd[1].events = half_events(&down, true) | half_events(&up, false);
+        pfd[0].revents = pfd[1].revents = 0;
+
+        // a descriptor we wait nothing from is left out, otherwise a hung
+        // up peer would make poll return at once forever
+        if (pfd[0].events == 0) {
+            pfd[0].fd = -1;
+        }
+        if (pfd[1].events == 0) {
+            pfd[1].fd = -1;
+        }
+
+        int n = poll(pfd, 2, idle_timeout_ms > 0 ? idle_timeout_ms : -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            goto out;   // error or idle for too long
+        }
+        if (half_pump(&up) < 0 || half_pump(&down) < 0) {
+            goto out;
+        }
+    }
+    rc = 0;
+
+out:
+    close(up.pipefd[0]);
+    close(up.pipefd[1]);
+    if (down.pipefd[0] >= 0) {
+        close(down.pipefd[0]);
+        close(down.pipefd[1]);
+    }
+    return rc;
+}
@@ -0,0 +1,12 @@
+/*                                                                            *
+ *  tunnel.h                                                                  *
+ *  this file is head file for tunnel.c  :)                                   *
+ *  relays an established CONNECT tunnel between two sockets                  *
+ *                                                                            *
+ */
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+int tunnel_relay(int fd1, int fd2, int idle_timeout_ms);
+
+#endif
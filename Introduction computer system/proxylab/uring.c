@@ -0,0 +1,500 @@
+/*                                                                            *
+ *  uring.c                                                                   *
+ *  this file is an optional io_uring backend for the web proxy  . :)         *
+ *  rings are set up with the raw syscalls, so there is no liburing           *
+ *  dependency. every thread borrows a ring from a pool and gives it back     *
+ *  when it exits, so per-connection threads do not pay for setup. each ring  *
+ *  owns two registered relay buffers for READ_FIXED                          *
+ *                                                                            *
+ */
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING_SUPPORTED 1
+#endif
+#endif
+
+#ifdef URING_SUPPORTED
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+/* one submission/completion ring pair */
+typedef struct ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+    bool fixed;                        // relay buffers are registered
+    bool accept_armed;                 // a multishot accept is pending
+    char *bufs[URING_RELAY_BUFS];
+    struct ring *next;                 // free list link
+} ring_t;
+
+static bool enabled;
+static bool multishot_accept = true;
+static unsigned ring_entries;
+static ring_t *free_rings;
+static sem_t pool_mutex;
+static pthread_key_t ring_key;
+static __thread ring_t *my_ring;
+
+/*
+ * ring_create : io_uring_setup plus the three mappings, NULL on failure
+ */
+static ring_t *ring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    ring_t *r = (ring_t *)Calloc(1, sizeof(ring_t));
+    r->fd = fd;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) {
+            r->sq_size = r->cq_size;
+        }
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_size);
+            goto fail;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_size);
+        if (r->cq_ptr != r->sq_ptr) {
+            munmap(r->cq_ptr, r->cq_size);
+        }
+        goto fail;
+    }
+
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // relay buffers, registered once so reads can use READ_FIXED
+    struct iovec iov[URING_RELAY_BUFS];
+    int i;
+    for (i = 0; i < URING_RELAY_BUFS; i++) {
+        r->bufs[i] = (char *)Malloc(MAXBUF);
+        iov[i].iov_base = r->bufs[i];
+        iov[i].iov_len = MAXBUF;
+    }
+    r->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                       iov, URING_RELAY_BUFS) == 0;
+    return r;
+
+fail:
+    close(fd);
+    Free(r);
+    return NULL;
+}
+
+/*
+ * ring_release : thread exit hook, hand the ring back to the pool
+ */
+static void ring_release(void *arg)
+{
+    ring_t *r = (ring_t *)arg;
+    P(&pool_mutex);
+    r->next = free_rings;
+    free_rings = r;
+    V(&pool_mutex);
+}
+
+/*
+ * ring_get : the calling thread's ring, borrowed from the pool on first use
+ */
+static ring_t *ring_get(void)
+{
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    P(&pool_mutex);
+    ring_t *r = free_rings;
+    if (r != NULL) {
+        free_rings = r->next;
+    }
+    V(&pool_mutex);
+
+    if (r == NULL && (r = ring_create(ring_entries)) == NULL) {
+        return NULL;
+    }
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+/*
+ * ring_sqe : next free submission entry, cleared
+ */
+static struct io_uring_sqe *ring_sqe(ring_t *r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*
+ * ring_enter : submit whatever the kernel has not consumed yet and wait for
+ * at least min_complete completions, restarting after signals
+ */
+static int ring_enter(ring_t *r, unsigned min_complete)
+{
+    int rc;
+    do {
+        unsigned to_submit = *r->sq_tail
+                - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        rc = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+/*
+ * ring_cqe : pop one completion if there is one
+ */
+static bool ring_cqe(ring_t *r, struct io_uring_cqe *out)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *out = r->cqes[head & r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * ring_drop : take a ring that failed with requests in flight away from
+ * the calling thread for good, so it never goes back to the pool where
+ * its stale completions would reach the next user. Unmapping and closing
+ * it drops the last references, so the kernel tears it down and cancels
+ * what is left. The relay buffers are leaked on purpose: the kernel may
+ * still write into them until that is done.
+ */
+static void ring_drop(ring_t *r)
+{
+    pthread_setspecific(ring_key, NULL);
+    my_ring = NULL;
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+    Free(r);
+}
+
+/*
+ * ring_drain : io_uring_enter failed with pending completions still owed
+ * for the operations tagged 1 and 2 and their linked timeouts. Cancel the
+ * operations and reap every completion, so nothing in flight still uses
+ * the caller's memory once we return. If the ring cannot even do that it
+ * is dropped.
+ */
+static void ring_drain(ring_t *r, int pending)
+{
+    struct io_uring_cqe cqe;
+    __u64 ud;
+    int tries = 0;
+    for (ud = 1; ud <= 2; ud++) {
+        struct io_uring_sqe *sqe = ring_sqe(r);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ud;
+        sqe->user_data = 4;
+        pending++;
+    }
+    while (pending > 0) {
+        if (ring_cqe(r, &cqe)) {
+            pending--;
+            continue;
+        }
+        if (ring_enter(r, 1) < 0) {
+            if ((errno != EAGAIN && errno != EBUSY) || ++tries > 100) {
+                ring_drop(r);
+                return;
+            }
+            poll(NULL, 0, 10);    // short of kernel memory, let it pass
+        }
+    }
+}
+
+/*
+ * uring_init : probe io_uring once at startup. Returns false, and leaves
+ * every call on the read/write fallback, when the kernel refuses.
+ */
+bool uring_init(unsigned entries)
+{
+    Sem_init(&pool_mutex, 0, 1);
+    ring_entries = entries;
+
+    ring_t *r = ring_create(entries);
+    if (r == NULL) {
+        fprintf(stderr, "io_uring unavailable (%s), using read/write\n",
+                strerror(errno));
+        return false;
+    }
+    if (pthread_key_create(&ring_key, ring_release) != 0) {
+        return false;
+    }
+    free_rings = r;
+    enabled = true;
+    return true;
+}
+
+bool uring_enabled(void)
+{
+    return enabled;
+}
+
+/*
+ * uring_relay_buf : the calling thread's i-th registered relay buffer,
+ * NULL when io_uring is off
+ */
+char *uring_relay_buf(int i)
+{
+    ring_t *r = enabled ? ring_get() : NULL;
+    return r == NULL ? NULL : r->bufs[i];
+}
+
+/*
+ * uring_accept : next connection from a multishot accept. One submission
+ * keeps producing descriptors until the kernel drops it, and several
+ * pending connections are reaped with a single io_uring_enter.
+ * The peer address is not reported, use getpeername() for it.
+ */
+int uring_accept(int listenfd)
+{
+    ring_t *r = enabled && multishot_accept ? ring_get() : NULL;
+    if (r == NULL) {
+        return accept(listenfd, NULL, NULL);
+    }
+
+    struct io_uring_cqe cqe;
+    while (1) {
+        if (!r->accept_armed) {
+            struct io_uring_sqe *sqe = ring_sqe(r);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listenfd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            r->accept_armed = true;
+        }
+        if (!ring_cqe(r, &cqe)) {
+            if (ring_enter(r, 1) < 0) {
+                // the armed accept must not outlive this ring's owner
+                int err = errno;
+                ring_drop(r);
+                errno = err;
+                return -1;
+            }
+            continue;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            r->accept_armed = false;
+        }
+        if (cqe.res >= 0) {
+            return cqe.res;
+        }
+        if (cqe.res == -EINVAL) {
+            // kernel without multishot accept, stay on accept()
+            multishot_accept = false;
+            return accept(listenfd, NULL, NULL);
+        }
+        errno = -cqe.res;
+        return -1;
+    }
+}
+
+/*
+ * link_timeout : bound the submission just queued by ms milliseconds with
+ * a linked timeout, since io_uring ignores SO_RCVTIMEO and SO_SNDTIMEO.
+ * ts must outlive the submission. Returns the extra completions to reap.
+ */
+static int link_timeout(ring_t *r, struct io_uring_sqe *sqe,
+                        struct __kernel_timespec *ts, int ms)
+{
+    if (ms <= 0) {
+        return 0;
+    }
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000L;
+    sqe->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe *t = ring_sqe(r);
+    t->opcode = IORING_OP_LINK_TIMEOUT;
+    t->addr = (unsigned long)ts;
+    t->len = 1;
+    t->user_data = 3;
+    return 1;
+}
+
+/*
+ * uring_writev_read : write iov to wfd and read up to rlen bytes of rfd
+ * into rbuf with one io_uring_enter. The two calls run concurrently, so
+ * rbuf must not be one of the buffers in iov. The write is given up after
+ * wtimeout_ms and the read after rtimeout_ms (0: no limit), failing with
+ * EAGAIN like a socket timeout. *pwritten gets the writev result (may be
+ * short); the read result is returned, -1 with errno set. Nothing is left
+ * in flight on return, even when io_uring_enter fails.
+ */
+ssize_t uring_writev_read(int wfd, struct iovec *iov, int iovcnt,
+                          ssize_t *pwritten, int wtimeout_ms,
+                          int rfd, char *rbuf, size_t rlen, int rtimeout_ms)
+{
+    ring_t *r = enabled ? ring_get() : NULL;
+    if (r == NULL) {
+        *pwritten = iovcnt > 0 ? writev(wfd, iov, iovcnt) : 0;
+        return read(rfd, rbuf, rlen);
+    }
+
+    struct __kernel_timespec wts, rts;
+    int pending = 1;
+    *pwritten = iovcnt > 0 ? -1 : 0;    // until the writev reports
+    if (iovcnt > 0) {
+        struct io_uring_sqe *sqe = ring_sqe(r);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = wfd;
+        sqe->addr = (unsigned long)iov;
+        sqe->len = iovcnt;
+        sqe->user_data = 1;
+        pending++;
+        pending += link_timeout(r, sqe, &wts, wtimeout_ms);
+    }
+
+    struct io_uring_sqe *sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = rfd;
+    sqe->addr = (unsigned long)rbuf;
+    sqe->len = rlen;
+    sqe->off = (__u64)-1;    // current position, sockets ignore it
+    sqe->user_data = 2;
+    int i;
+    for (i = 0; r->fixed && i < URING_RELAY_BUFS; i++) {
+        if (rbuf >= r->bufs[i] && rbuf + rlen <= r->bufs[i] + MAXBUF) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = i;
+            break;
+        }
+    }
+    pending += link_timeout(r, sqe, &rts, rtimeout_ms);
+
+    ssize_t nread = -1;
+    int err = 0;
+    struct io_uring_cqe cqe;
+    while (pending > 0) {
+        if (!ring_cqe(r, &cqe)) {
+            if (ring_enter(r, pending) < 0) {
+                int saved = errno;
+                ring_drain(r, pending);
+                errno = saved;
+                return -1;
+            }
+            continue;
+        }
+        pending--;
+        if (cqe.user_data == 3) {
+            continue;   // a linked timeout, fired or cancelled
+        }
+        // an operation cancelled by its timeout reports like SO_RCVTIMEO
+        int res = cqe.res == -ECANCELED ? -EAGAIN : cqe.res;
+        if (cqe.user_data == 1) {
+            *pwritten = res;
+            if (res < 0) {
+                err = -res;
+            }
+        } else {
+            nread = res;
+            if (res < 0) {
+                err = -res;
+                nread = -1;
+            }
+        }
+    }
+    if (nread < 0 || *pwritten < 0) {
+        errno = err;
+        return -1;
+    }
+    return nread;
+}
+
+#else /* !URING_SUPPORTED */
+
+bool uring_init(unsigned entries)
+{
+    (void)entries;
+    fprintf(stderr, "io_uring not supported on this platform\n");
+    return false;
+}
+
+bool uring_enabled(void)
+{
+    return false;
+}
+
+char *uring_relay_buf(int i)
+{
+    (void)i;
+    return NULL;
+}
+
+int uring_accept(int listenfd)
+{
+    return accept(listenfd, NULL, NULL);
+}
+
+ssize_t uring_writev_read(int wfd, struct iovec *iov, int iovcnt,
+                          ssize_t *pwritten, int wtimeout_ms,
+                          int rfd, char *rbuf, size_t rlen, int rtimeout_ms)
+{
+    (void)wtimeout_ms;  // plain calls obey the socket timeouts
+    (void)rtimeout_ms;
+    *pwritten = iovcnt > 0 ? writev(wfd, iov, iovcnt) : 0;
+    return read(rfd, rbuf, rlen);
+}
+
+#endif /* URING_SUPPORTED */
@@ -0,0 +1,26 @@
+/*                                                                            *
+ *  uring.h                                                                   *
+ *  this file is head file for uring.c  :)                                    *
+ *  an optional io_uring backend for the proxy's accept loop and body relay,  *
+ *  every call falls back to plain accept/read/writev when io_uring is off    *
+ *  or not supported by the kernel                                            *
+ *                                                                            *
+ */
+#ifndef URING_H
+#define URING_H
+
+#include "csapp.h"
+#include <stdbool.h>
+
+/* registered relay buffers per ring, each MAXBUF bytes */
+#define URING_RELAY_BUFS 2
+
+bool uring_init(unsigned entries);
+bool uring_enabled(void);
+char *uring_relay_buf(int i);
+int uring_accept(int listenfd);
+ssize_t uring_writev_read(int wfd, struct iovec *iov, int iovcnt,
+                          ssize_t *pwritten, int wtimeout_ms,
+                          int rfd, char *rbuf, size_t rlen, int rtimeout_ms);
+
+#endif